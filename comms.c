@@ -15,39 +15,167 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <string.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
 #include "risu.h"
 
+int comms_timeout = 0;
+int64_t run_deadline = 0;
+
+int64_t monotonic_ms(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * (int64_t)1000 + ts.tv_nsec / 1000000;
+}
+
+/* Wait until fd is ready for events (POLLIN or POLLOUT), giving up
+ * if we pass the deadline for this operation or the whole run.
+ * With no deadlines we just let the read or write block.
+ */
+static void wait_for(int fd, short events)
+{
+   int64_t deadline = run_deadline;
+   if (comms_timeout)
+   {
+      int64_t d = monotonic_ms() + comms_timeout;
+      if (!deadline || d < deadline)
+      {
+         deadline = d;
+      }
+   }
+   if (!deadline)
+   {
+      return;
+   }
+   for (;;)
+   {
+      struct pollfd pfd;
+      int64_t left = deadline - monotonic_ms();
+      int r;
+      pfd.fd = fd;
+      pfd.events = events;
+      r = poll(&pfd, 1, left > 0 ? left : 0);
+      if (r > 0)
+      {
+         return;
+      }
+      if (r == 0)
+      {
+         comms_timed_out();
+      }
+      if (errno != EINTR)
+      {
+         perror("poll");
+         exit(1);
+      }
+   }
+}
+
+static int timed_connect(int sock, const struct sockaddr *addr,
+                         socklen_t addrlen)
+{
+   /* connect() without blocking, so that wait_for() can give up
+    * on a master which never answers.
+    */
+   int flags, err = 0;
+   socklen_t errlen = sizeof(err);
+   if (!comms_timeout && !run_deadline)
+   {
+      return connect(sock, addr, addrlen);
+   }
+   flags = fcntl(sock, F_GETFL);
+   fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+   if (connect(sock, addr, addrlen) < 0)
+   {
+      if (errno != EINPROGRESS)
+      {
+         return -1;
+      }
+      wait_for(sock, POLLOUT);
+      if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+      {
+         return -1;
+      }
+      if (err)
+      {
+         errno = err;
+         return -1;
+      }
+   }
+   /* The rest of the comms code expects blocking reads and writes */
+   fcntl(sock, F_SETFL, flags);
+   return 0;
+}
+
 int apprentice_connect(const char *hostname, int port)
 {
-   /* We are the client end of the TCP connection */
+   /* We are the client end of the TCP connection. (Not
+    * gethostbyname(), since each thread looks up the host.)
+    */
    int sock;
+#ifdef RISU_STATIC
+   /* glibc can only look up host names with its shared libraries, so
+    * a static build takes numeric addresses only, apart from the
+    * default of localhost.
+    */
    struct sockaddr_in sa;
+#else
+   int r;
+   struct addrinfo hints, *ai;
+   char portstr[8];
+#endif
    sock = socket(PF_INET, SOCK_STREAM, 0);
    if (sock < 0)
    {
       perror("socket");
       exit(1);
    }
-   struct hostent *hostinfo;
+#ifdef RISU_STATIC
+   memset(&sa, 0, sizeof(sa));
    sa.sin_family = AF_INET;
    sa.sin_port = htons(port);
-   hostinfo = gethostbyname(hostname);
-   if (!hostinfo)
+   if (strcmp(hostname, "localhost") == 0)
+   {
+      hostname = "127.0.0.1";
+   }
+   if (inet_pton(AF_INET, hostname, &sa.sin_addr) != 1)
    {
-      fprintf(stderr, "Unknown host %s\n", hostname);
+      fprintf(stderr, "%s isn't an IPv4 address (a static risu can't look "
+              "up host names)\n", hostname);
       exit(1);
    }
-   sa.sin_addr = *(struct in_addr*)hostinfo->h_addr;
-   if (connect(sock, (struct sockaddr*)&sa, sizeof(sa)) < 0)
+   if (timed_connect(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0)
    {
       perror("connect");
       exit(1);
    }
+#else
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   snprintf(portstr, sizeof(portstr), "%d", port);
+   r = getaddrinfo(hostname, portstr, &hints, &ai);
+   if (r != 0)
+   {
+      fprintf(stderr, "Unknown host %s: %s\n", hostname, gai_strerror(r));
+      exit(1);
+   }
+   if (timed_connect(sock, ai->ai_addr, ai->ai_addrlen) < 0)
+   {
+      perror("connect");
+      exit(1);
+   }
+   freeaddrinfo(ai);
+#endif
    return sock;
 }
 
@@ -85,6 +213,7 @@ int master_connect(int port)
    fprintf(stderr, "master: waiting for connection on port %d...\n", port);
    struct sockaddr_in csa;
    socklen_t csasz = sizeof(csa);
+   wait_for(sock, POLLIN);
    int nsock = accept(sock, (struct sockaddr*)&csa, &csasz);
    if (nsock < 0)
    {
@@ -96,6 +225,85 @@ int master_connect(int port)
    return nsock;
 }
 
+pid_t spawn_apprentice(const char *cmd, char **args,
+                       int nsocks, int fdbase, int *socks)
+{
+   /* Run cmd with args appended through the shell, connected to
+    * us by nsocks socket pairs instead of TCP: the child gets the
+    * other ends as fds fdbase onwards.
+    */
+   int sv[2], i;
+   int *child = calloc(nsocks, sizeof(int));
+   pid_t pid;
+
+   for (i = 0; i < nsocks; i++)
+   {
+      if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) < 0)
+      {
+         perror("socketpair");
+         exit(1);
+      }
+      socks[i] = sv[0];
+      child[i] = sv[1];
+   }
+
+   pid = fork();
+   if (pid < 0)
+   {
+      perror("fork");
+      exit(1);
+   }
+   if (pid == 0)
+   {
+      char *script = malloc(strlen(cmd) + 8);
+      char **argv;
+      int nargs = 0;
+
+      /* Move our ends out of the range they have to end up in
+       * first, in case some of them are already there.
+       */
+      for (i = 0; i < nsocks; i++)
+      {
+         child[i] = fcntl(child[i], F_DUPFD_CLOEXEC, fdbase + nsocks);
+         if (child[i] < 0)
+         {
+            perror("fcntl");
+            _exit(127);
+         }
+      }
+      for (i = 0; i < nsocks; i++)
+      {
+         if (dup2(child[i], fdbase + i) < 0)
+         {
+            perror("dup2");
+            _exit(127);
+         }
+      }
+
+      while (args[nargs])
+      {
+         nargs++;
+      }
+      argv = calloc(nargs + 5, sizeof(char *));
+      sprintf(script, "%s \"$@\"", cmd);
+      argv[0] = "/bin/sh";
+      argv[1] = "-c";
+      argv[2] = script;
+      argv[3] = "sh";
+      memcpy(argv + 4, args, nargs * sizeof(char *));
+      execv(argv[0], argv);
+      perror("execv /bin/sh");
+      _exit(127);
+   }
+
+   for (i = 0; i < nsocks; i++)
+   {
+      close(child[i]);
+   }
+   free(child);
+   return pid;
+}
+
 /* Utility functions which are just wrappers around read and writev
  * to catch errors and retry on short reads/writes.
  */
@@ -104,6 +312,7 @@ static void recv_bytes(int sock, void *pkt, int pktlen)
    char *p = pkt;
    while (pktlen)
    {
+      wait_for(sock, POLLIN);
       int i = read(sock, p, pktlen);
       if (i <= 0)
       {
@@ -131,6 +340,7 @@ static void recv_and_discard_bytes(int sock, int pktlen)
       {
          len = pktlen;
       }
+      wait_for(sock, POLLIN);
       i = read(sock, dumpbuf, len);
       if (i <= 0)
       {
@@ -152,6 +362,7 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
    struct iovec *iov = iov_in;
    for (;;)
    {
+      wait_for(fd, POLLOUT);
       ssize_t i = writev(fd, iov, iovcnt);
       if (i == -1)
       {
@@ -204,6 +415,7 @@ int send_data_pkt(int sock, void *pkt, int pktlen)
       exit(1);
    }
 
+   wait_for(sock, POLLIN);
    if (read(sock, &resp, 1) != 1)
    {
       perror("read failed");
@@ -232,6 +444,7 @@ int recv_data_pkt(int sock, void *pkt, int pktlen)
 void send_response_byte(int sock, int resp)
 {
    unsigned char r = resp;
+   wait_for(sock, POLLOUT);
    if (write(sock, &r, 1) != 1)
    {
       perror("write failed");
@@ -23,28 +23,291 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <link.h>
 
 #include "risu.h"
 
-void *memblock = 0;
+/* With --threads each thread runs its own copy of a test image,
+ * so everything about the image and the test run is thread-local,
+ * which also makes it safe to use from the signal handlers.
+ */
+__thread void *memblock = 0;
 
-int apprentice_socket, master_socket;
+/* The memory block risu maps after the image, and whether
+ * to try to back it with a huge page.
+ */
+static __thread uint8_t *image_memblock;
+int memblock_hugepages = 0;
 
-sigjmp_buf jmpbuf;
+__thread int apprentice_socket, master_socket;
+int ismaster;
+
+__thread sigjmp_buf jmpbuf;
+static __thread int apprentice_status;
+
+/* One thread's test run: thread i runs its own copy of its image,
+ * talking to the other end on port + i.
+ */
+struct risu_thread {
+   pthread_t thread;
+   int index;
+   const char *imgfile;
+   const char *hostname;
+   uint16_t port;
+   int fd;              /* already connected to the other end, or -1 */
+   int status;
+   /* The pc offset of the last compare which matched, so that if
+    * the test stalls we can say how far it got
+    */
+   uintptr_t last_match_pc;
+   int last_match_valid;
+};
+
+/* All the threads, and which this is (and its image) for the reports */
+int nthreads = 1;
+static struct risu_thread *risu_threads;
+static __thread struct risu_thread *this_thread;
+static __thread int thread_index;
+static __thread const char *thread_image;
 
 /* Should we test for FP exception status bits? */
 int test_fp_exc = 0;
 
+/* How many mismatches the master will resynchronise the apprentice
+ * after and carry on, rather than stopping at the first. We keep
+ * count of them per pattern (or, with no map or index to tell us the
+ * pattern, per opcode) for the summary at the end.
+ */
+int max_mismatches = 0;
+
+struct mismatch_group {
+   const char *name;    /* the pattern, or 0 to go by insn */
+   uint32_t insn;
+   uintptr_t first_pc;
+   int count, memory;
+};
+
+/* The optional features both ends support (RISU_FEATURE_*), as
+ * agreed in the handshake
+ */
+static __thread uint32_t features;
+
+#define MAX_MISMATCH_GROUPS 1024
+static __thread struct mismatch_group mismatch_groups[MAX_MISMATCH_GROUPS];
+static __thread int num_mismatch_groups, num_mismatches;
+
+int continue_after_mismatch(uint32_t insn, uintptr_t pc, int memory)
+{
+   /* NB: called from a signal handler, but the code it interrupted
+    * is the test image, so stdio is OK to use here.
+    */
+   struct mismatch_group *g;
+   const char *name;
+   uint32_t offset;
+   int i;
+
+   if (!locate_test_insn(pc, &offset, &name))
+   {
+      name = 0;
+   }
+   num_mismatches++;
+   for (i = 0; i < num_mismatch_groups; i++)
+   {
+      g = &mismatch_groups[i];
+      if (g->memory == memory
+          && (name ? g->name && strcmp(g->name, name) == 0
+                   : !g->name && g->insn == insn))
+      {
+         break;
+      }
+   }
+   if (i == num_mismatch_groups && i < MAX_MISMATCH_GROUPS)
+   {
+      g = &mismatch_groups[num_mismatch_groups++];
+      g->name = name;
+      g->insn = insn;
+      g->first_pc = pc;
+      g->memory = memory;
+   }
+   if (i < MAX_MISMATCH_GROUPS)
+   {
+      g->count++;
+   }
+
+   if (num_mismatches > max_mismatches
+       || !(features & RISU_FEATURE_RESYNC))
+   {
+      return 0;
+   }
+   fprintf(stderr, "mismatch %d on %s after insn %08x at pc offset %#"
+           PRIxPTR ", continuing\n", num_mismatches,
+           memory ? "memory" : "regs", insn, pc);
+   report_test_insn(stderr, pc);
+   return 1;
+}
+
+static int report_mismatch_summary(void)
+{
+   int i;
+   if (!max_mismatches || !num_mismatches)
+   {
+      return 0;
+   }
+   fprintf(stderr, "%d mismatches, %d distinct:\n",
+           num_mismatches, num_mismatch_groups);
+   for (i = 0; i < num_mismatch_groups; i++)
+   {
+      struct mismatch_group *g = &mismatch_groups[i];
+      if (g->name)
+      {
+         fprintf(stderr, "  %s: ", g->name);
+      }
+      else
+      {
+         fprintf(stderr, "  insn %08x: ", g->insn);
+      }
+      fprintf(stderr, "%d on %s, first at pc offset %#" PRIxPTR "\n",
+              g->count, g->memory ? "memory" : "regs", g->first_pc);
+      report_test_insn(stderr, g->first_pc);
+   }
+   return 1;
+}
+
+static void note_match(void *uc)
+{
+   this_thread->last_match_pc = get_pc(uc) - image_start_address;
+   this_thread->last_match_valid = 1;
+}
+
+static void report_last_match(struct risu_thread *t)
+{
+   if (t->last_match_valid)
+   {
+      fprintf(stderr, "last match at pc offset %#" PRIxPTR "\n",
+              t->last_match_pc);
+   }
+   else
+   {
+      fprintf(stderr, "no compares matched\n");
+   }
+}
+
+/* The spawned apprentice, until it has been reaped */
+static pid_t apprentice_pid;
+
+static void kill_apprentice(void)
+{
+   /* Runs on every exit of the master, so that a timeout or an
+    * error doesn't leave the apprentice running the test on its own.
+    */
+   if (apprentice_pid)
+   {
+      kill(apprentice_pid, SIGKILL);
+      waitpid(apprentice_pid, 0, 0);
+      apprentice_pid = 0;
+   }
+}
+
+void comms_timed_out(void)
+{
+   /* NB: may be called from the SIGILL handler, but only while it
+    * talks to the other end, and the code it interrupted is the
+    * test image, so stdio is OK to use here. (The run timer, which
+    * can go off at any point, doesn't come through here: see
+    * run_timer_fn().)
+    */
+   if (nthreads > 1)
+   {
+      fprintf(stderr, "thread %d: ", thread_index);
+   }
+   fprintf(stderr, "timed out waiting for %s: ",
+           ismaster ? "apprentice" : "master");
+   report_last_match(this_thread);
+   kill_apprentice();
+   exit(EXIT_TIMEOUT);
+}
+
+static void *run_timer_fn(void *arg)
+{
+   /* The socket routines only check run_deadline while we wait for
+    * the other end, so this thread catches the rest (a test image
+    * stuck in a loop, say) and reports how far every thread got.
+    * It's a thread rather than a signal because any thread could
+    * take the signal, in the middle of anything.
+    */
+   struct timespec ts;
+   int i;
+
+   ts.tv_sec = run_deadline / 1000;
+   ts.tv_nsec = (run_deadline % 1000) * 1000000;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) != 0)
+   {
+      continue;
+   }
+   for (i = 0; i < nthreads; i++)
+   {
+      if (nthreads > 1)
+      {
+         fprintf(stderr, "thread %d: ", i);
+      }
+      fprintf(stderr, "run timed out: ");
+      report_last_match(&risu_threads[i]);
+   }
+   kill_apprentice();
+   exit(EXIT_TIMEOUT);
+}
+
+static void start_run_timer(void)
+{
+   pthread_t thread;
+   if (pthread_create(&thread, 0, run_timer_fn, 0))
+   {
+      fprintf(stderr, "failed to create run timer thread\n");
+      exit(1);
+   }
+}
+
+/* Details of the fault signal we are handling, if any */
+__thread int fault_signal, fault_code;
+__thread uint64_t fault_addr;
+
+static void set_fault_info(int sig, siginfo_t *si)
+{
+   /* For SIGILL we leave these zero: the si_code for an UNDEF
+    * differs between the kernel and qemu, for instance.
+    */
+   if (sig == SIGILL)
+   {
+      fault_signal = fault_code = fault_addr = 0;
+      return;
+   }
+   fault_signal = sig;
+   fault_code = si->si_code;
+   fault_addr = normalise_address((uintptr_t)si->si_addr);
+}
+
 void master_sigill(int sig, siginfo_t *si, void *uc)
 {
+   set_fault_info(sig, si);
    switch (recv_and_compare_register_info(master_socket, uc))
    {
       case 0:
          /* match OK */
+         note_match(uc);
+         advance_pc(uc);
+         return;
+      case 3:
+         /* mismatch but we carry on */
          advance_pc(uc);
          return;
+      case 4:
+         /* on to the next chunk of the stream */
+         return;
       default:
          /* mismatch, or end of test */
          siglongjmp(jmpbuf, 1);
@@ -53,46 +316,1072 @@ void master_sigill(int sig, siginfo_t *si, void *uc)
 
 void apprentice_sigill(int sig, siginfo_t *si, void *uc)
 {
+   set_fault_info(sig, si);
    switch (send_register_info(apprentice_socket, uc))
    {
       case 0:
          /* match OK */
+         note_match(uc);
+         advance_pc(uc);
+         return;
+      case 3:
+         /* mismatch, and we now have the master's state */
          advance_pc(uc);
          return;
+      case 4:
+         /* on to the next chunk of the stream */
+         return;
       case 1:
          /* end of test */
-         exit(0);
+         apprentice_status = 0;
+         siglongjmp(jmpbuf, 1);
       default:
          /* mismatch */
-         exit(1);
+         apprentice_status = 1;
+         siglongjmp(jmpbuf, 1);
+   }
+}
+
+/* --bench mode: rather than comparing with a master we time the
+ * regions between OP_MARKER ops, accumulating per region name.
+ * Regions with an empty name (risugen's register reloads) are
+ * timed but not reported.
+ */
+int bench = 0;
+
+struct bench_region {
+   const char *name;    /* points into the image */
+   uint64_t regions, insns, ns;
+};
+
+#define BENCH_MAX_NAMES 4096
+static __thread struct bench_region bench_names[BENCH_MAX_NAMES];
+static __thread struct bench_region *bench_cur;
+/* Where the regions go once the table is full */
+static __thread struct bench_region bench_overflow;
+static __thread struct timespec bench_start, bench_total_start;
+static __thread uint64_t bench_traps;
+
+static struct bench_region *bench_lookup(const char *name)
+{
+   /* Simple open-addressed hash table, since we have to
+    * do this in the signal handler.
+    */
+   uint32_t h = 5381;
+   const char *p;
+   int i;
+   for (p = name; *p; p++)
+   {
+      h = h * 33 + (uint8_t)*p;
+   }
+   for (i = 0; i < BENCH_MAX_NAMES; i++)
+   {
+      struct bench_region *r = &bench_names[h % BENCH_MAX_NAMES];
+      if (!r->name)
+      {
+         r->name = name;
+         return r;
+      }
+      if (strcmp(r->name, name) == 0)
+      {
+         return r;
+      }
+      h++;
+   }
+   bench_overflow.name = "(other)";
+   return &bench_overflow;
+}
+
+static uint64_t ns_between(struct timespec *a, struct timespec *b)
+{
+   return (b->tv_sec - a->tv_sec) * 1000000000ULL + b->tv_nsec - a->tv_nsec;
+}
+
+void bench_sigill(int sig, siginfo_t *si, void *uc)
+{
+   /* Time spent in here doesn't count towards the region,
+    * though the cost of taking the signal does.
+    */
+   struct timespec now;
+   void *payload;
+   uint32_t insns;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   if (bench_cur)
+   {
+      bench_cur->ns += ns_between(&bench_start, &now);
+   }
+   bench_traps++;
+
+   switch (bench_risuop(uc, &payload))
+   {
+      case OP_TESTEND:
+         bench_start = now;
+         siglongjmp(jmpbuf, 1);
+      case OP_MARKER:
+         /* the payload is only 2-aligned in Thumb */
+         memcpy(&insns, payload, 4);
+         bench_cur = bench_lookup((char *)payload + 4);
+         bench_cur->regions++;
+         bench_cur->insns += insns;
+         break;
+      case OP_NEXTCHUNK:
+         next_chunk(uc);
+         clock_gettime(CLOCK_MONOTONIC, &bench_start);
+         return;
+      default:
+         /* compares, and anything else, are just skipped */
+         break;
+   }
+   advance_pc(uc);
+   clock_gettime(CLOCK_MONOTONIC, &bench_start);
+}
+
+/* As well as SIGILL for the risuops, we catch the other synchronous
+ * fault signals a test insn might raise, and compare them in the
+ * same way as an unexpected UNDEF, then skip the insn.
+ */
+static const int fault_signals[] = { SIGILL, SIGSEGV, SIGBUS, SIGFPE };
+
+void fast_trap(void *uc)
+{
+   /* Just what the SIGILL handler would do, without the signal */
+   if (bench)
+   {
+      bench_sigill(SIGILL, 0, uc);
+   }
+   else if (ismaster)
+   {
+      master_sigill(SIGILL, 0, uc);
+   }
+   else
+   {
+      apprentice_sigill(SIGILL, 0, uc);
    }
 }
 
 static void set_sigill_handler(void (*fn)(int, siginfo_t *, void *))
 {
    struct sigaction sa;
+   int i;
    memset(&sa, 0, sizeof(struct sigaction));
 
    sa.sa_sigaction = fn;
    sa.sa_flags = SA_SIGINFO;
+   /* Block them all in the handler, so that if risu itself
+    * faults we die rather than trying to compare that.
+    */
    sigemptyset(&sa.sa_mask);
-   if (sigaction(SIGILL, &sa, 0) != 0)
+   for (i = 0; i < sizeof(fault_signals) / sizeof(fault_signals[0]); i++)
+   {
+      sigaddset(&sa.sa_mask, fault_signals[i]);
+   }
+   for (i = 0; i < sizeof(fault_signals) / sizeof(fault_signals[0]); i++)
+   {
+      if (sigaction(fault_signals[i], &sa, 0) != 0)
+      {
+         perror("sigaction");
+         exit(1);
+      }
+   }
+}
+
+typedef void entrypoint_fn(void);
+
+__thread uintptr_t image_start_address;
+__thread entrypoint_fn *image_start;
+/* Where we start running it: the start, or a --start-at checkpoint */
+static __thread entrypoint_fn *image_entry;
+long start_at = 0;
+__thread size_t image_len;
+/* The image and memory block mapping, for normalise_address() */
+static __thread size_t image_span;
+
+/* The parts of that which are actually mapped readable (it has
+ * PROT_NONE gaps), for image_contains()
+ */
+#define MAX_IMAGE_RANGES 64
+static __thread struct image_range {
+   uintptr_t start;
+   size_t len;
+} image_ranges[MAX_IMAGE_RANGES];
+static __thread int num_image_ranges;
+
+/* What the image says about itself: container images have an index
+ * of the test insns and the names of their patterns, and either kind
+ * can have a table of checkpoints.
+ */
+static __thread const uint32_t *image_index;
+static __thread uint32_t num_image_index;
+static __thread const char *image_names;
+static __thread size_t image_names_len;
+static __thread const uint32_t *image_checkpoints;
+static __thread uint32_t num_image_checkpoints;
+
+/* The image's map, if risugen wrote one (see risu.h) */
+static __thread const struct risu_map_entry *image_map;
+static __thread uint32_t num_image_map;
+static __thread const char *image_map_strings;
+
+/* Hash of the image file, which the master checks the apprentice's
+ * against so that they can't run different tests.
+ */
+static __thread uint64_t image_hash;
+
+/* A streamed image (see risu.h): the chunk we are running (counting
+ * from 1) and its length
+ */
+static __thread int image_stream;
+static __thread uint32_t stream_chunk, stream_chunk_len;
+
+#if defined(__aarch64__)
+#define RISU_HOST_ARCH RISU_IMAGE_ARCH_AARCH64
+#define RISU_HOST_EM EM_AARCH64
+#elif defined(__arm__)
+#define RISU_HOST_ARCH RISU_IMAGE_ARCH_ARM
+#define RISU_HOST_EM EM_ARM
+#endif
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uintptr_t)(a) - 1))
+
+uint64_t normalise_address(uintptr_t addr)
+{
+   if (addr - image_start_address < image_span)
+   {
+      return addr - image_start_address;
+   }
+   return addr;
+}
+
+static void note_mapped(void *addr, size_t len, int prot)
+{
+   /* Any ranges past the end of the table are just never read */
+   if ((prot & PROT_READ) && num_image_ranges < MAX_IMAGE_RANGES)
+   {
+      image_ranges[num_image_ranges].start = (uintptr_t)addr;
+      image_ranges[num_image_ranges].len = len;
+      num_image_ranges++;
+   }
+}
+
+int image_contains(uintptr_t addr, size_t len)
+{
+   int i;
+   for (i = 0; i < num_image_ranges; i++)
+   {
+      uintptr_t off = addr - image_ranges[i].start;
+      if (off < image_ranges[i].len && image_ranges[i].len - off >= len)
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+void seed_memblock(uint32_t seed)
+{
+   /* Both ends must generate the same data, so use a fixed
+    * generator (xorshift64*) rather than anything from libc.
+    * This is called from the signal handler.
+    */
+   uint32_t *p = (uint32_t *)image_memblock;
+   uint64_t x = seed ^ 0x9e3779b97f4a7c15ULL;
+   int i;
+   for (i = 0; i < MEMBLOCKLEN / 4; i++)
+   {
+      x ^= x >> 12;
+      x ^= x << 25;
+      x ^= x >> 27;
+      p[i] = (x * 0x2545f4914f6cdd1dULL) >> 32;
+   }
+   memblock = image_memblock;
+}
+
+void set_image_memblock(void *addr)
+{
+   /* Old style image with the memory block inside it:
+    * we have to let it write to itself.
+    */
+   if (mprotect(image_start, image_len,
+                PROT_READ|PROT_WRITE|PROT_EXEC) != 0)
+   {
+      perror("mprotect");
+      exit(1);
+   }
+   memblock = addr;
+}
+
+/* The registers the image's tests use, from OP_REGPROFILE */
+__thread int reg_profile = RISU_REGS_FULL;
+
+void set_reg_profile(uint64_t profile)
+{
+   /* Called from the signal handler. The other end has gone through
+    * the same OP_REGPROFILE, so we agree on the packet size.
+    */
+   if (profile > RISU_REGS_GPR)
+   {
+      fprintf(stderr, "unknown register profile %" PRIu64 "\n", profile);
+      exit(1);
+   }
+   reg_profile = profile;
+}
+
+static void map_memblock(void *addr)
+{
+   /* The memory block is data only, and prefaulted so that
+    * the first stores to it don't take page faults.
+    */
+   int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_POPULATE;
+   void *p = MAP_FAILED;
+   if (memblock_hugepages)
+   {
+      p = mmap(addr, MEMBLOCK_ALIGN, PROT_READ|PROT_WRITE,
+               flags|MAP_HUGETLB, -1, 0);
+      if (p == MAP_FAILED)
+      {
+         fprintf(stderr, "no huge page for memory block, "
+                 "using normal pages\n");
+      }
+   }
+   if (p == MAP_FAILED)
+   {
+      p = mmap(addr, MEMBLOCKLEN, PROT_READ|PROT_WRITE, flags, -1, 0);
+   }
+   if (p == MAP_FAILED)
+   {
+      perror("mmap memory block");
+      exit(1);
+   }
+   note_mapped(p, MEMBLOCKLEN, PROT_READ);
+   image_memblock = p;
+}
+
+static void map_fast_trap_slot(void *addr)
+{
+   /* Images generated with risugen --fast-trap load the address of
+    * the stub to call for their compares from here. We only write
+    * it the once, so the test code can't overwrite it.
+    */
+   size_t pagesize = sysconf(_SC_PAGESIZE);
+   uintptr_t *p = mmap(addr, pagesize, PROT_READ|PROT_WRITE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+   if (p == MAP_FAILED)
+   {
+      perror("mmap fast trap slot");
+      exit(1);
+   }
+   *p = (uintptr_t)fast_trap_entry;
+   if (mprotect(p, pagesize, PROT_READ) != 0)
+   {
+      perror("mprotect");
+      exit(1);
+   }
+}
+
+static void *reserve_image(size_t len)
+{
+   /* Reserve space for an image of len bytes followed by the memory
+    * block, aligned so that the memory block can go in a huge page,
+    * and map the memory block (and the fast trap slot after it).
+    */
+   size_t memoff = ALIGN_UP(len, MEMBLOCK_ALIGN);
+   void *addr = mmap(0, memoff + 2 * MEMBLOCK_ALIGN, PROT_NONE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+   if (addr == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+   addr = (void *)ALIGN_UP((uintptr_t)addr, MEMBLOCK_ALIGN);
+   image_start = image_entry = addr;
+   image_start_address = (uintptr_t)addr;
+   image_len = len;
+   image_span = memoff + MEMBLOCK_ALIGN;
+   num_image_ranges = 0;
+   map_memblock((char *)addr + memoff);
+   if (fast_trap_entry)
+   {
+      map_fast_trap_slot((char *)addr + memoff + MEMBLOCK_ALIGN);
+   }
+   return addr;
+}
+
+static void load_raw_image(int fd, const uint8_t *file, size_t len)
+{
+   void *addr = reserve_image(len);
+   uint32_t n;
+
+   /* The image itself is only ever read and executed */
+   if (mmap(addr, len, PROT_READ|PROT_EXEC,
+            MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+   note_mapped(addr, len, PROT_READ);
+
+   /* risugen --checkpoints puts a table of them at the end of the
+    * image: pairs of (insn index, offset) words, then the number of
+    * pairs and "RISUCKPT".
+    */
+   if (len >= 12 && memcmp(file + len - 8, "RISUCKPT", 8) == 0)
+   {
+      memcpy(&n, file + len - 12, 4);
+      if (n <= (len - 12) / 8)
+      {
+         image_checkpoints = (const uint32_t *)(file + len - 12) - 2 * n;
+         num_image_checkpoints = n;
+      }
+   }
+}
+
+static uint64_t hash_bytes(const uint8_t *p, size_t len)
+{
+   /* FNV-1a: only needs to tell different images (or register
+    * layouts) apart
+    */
+   uint64_t h = 0xcbf29ce484222325ULL;
+   while (len--)
+   {
+      h = (h ^ *p++) * 0x100000001b3ULL;
+   }
+   return h;
+}
+
+static void bad_image(const char *imgfile, const char *why)
+{
+   fprintf(stderr, "%s: bad image: %s\n", imgfile, why);
+   exit(1);
+}
+
+static void read_stream(void *buf, size_t len)
+{
+   /* Read from a streamed image on stdin, waiting for risugen
+    * to write it if need be. Called from the signal handler.
+    */
+   uint8_t *p = buf;
+   while (len)
+   {
+      ssize_t n = read(0, p, len);
+      if (n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if (n <= 0)
+      {
+         bad_image("-", n ? strerror(errno) : "stream ended early");
+      }
+      p += n;
+      len -= n;
+   }
+}
+
+static void load_stream(void)
+{
+   /* Reserve the place each chunk of a streamed image is run in.
+    * The chunks are loaded by load_next_chunk(), once we are talking
+    * to the other end. All that the handshake can check is that both
+    * ends are streaming, but the apprentice runs what we send it.
+    */
+   char magic[8];
+   void *addr = reserve_image(MEMBLOCK_ALIGN);
+   if (mmap(addr, MEMBLOCK_ALIGN, PROT_READ|PROT_EXEC,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+   note_mapped(addr, MEMBLOCK_ALIGN, PROT_READ);
+   if (ismaster || bench)
+   {
+      read_stream(magic, sizeof(magic));
+      if (memcmp(magic, RISU_STREAM_MAGIC, sizeof(magic)) != 0)
+      {
+         bad_image("-", "not a risugen --stream");
+      }
+   }
+   image_stream = 1;
+   image_hash = hash_bytes((const uint8_t *)RISU_STREAM_MAGIC, 8);
+}
+
+static void load_next_chunk(void)
+{
+   /* Load the next chunk of a streamed image over the last one:
+    * from stdin, passing it on to the apprentice, or from the master.
+    * Called from the signal handler.
+    */
+   uint8_t *code = (uint8_t *)image_start;
+   uint32_t len;
+
+   if (ismaster || bench)
+   {
+      read_stream(&len, sizeof(len));
+   }
+   else if (recv_data_pkt(apprentice_socket, &len, sizeof(len)))
+   {
+      fprintf(stderr, "bad chunk length packet from master\n");
+      exit(1);
+   }
+   else
+   {
+      send_response_byte(apprentice_socket, 0);
+   }
+   stream_chunk++;
+   if (len == 0 || len > MEMBLOCK_ALIGN)
+   {
+      fprintf(stderr, "-: bad image: chunk %u is %u bytes long\n",
+              stream_chunk, len);
+      exit(1);
+   }
+
+   if (mprotect(code, MEMBLOCK_ALIGN, PROT_READ|PROT_WRITE) != 0)
+   {
+      perror("mprotect");
+      exit(1);
+   }
+   if (ismaster || bench)
+   {
+      read_stream(code, len);
+   }
+   else if (recv_data_pkt(apprentice_socket, code, len))
+   {
+      fprintf(stderr, "bad chunk packet from master\n");
+      exit(1);
+   }
+   else
+   {
+      send_response_byte(apprentice_socket, 0);
+   }
+   /* so that nothing of the last chunk is left to run by mistake */
+   if (stream_chunk_len > len)
+   {
+      memset(code + len, 0, stream_chunk_len - len);
+   }
+   stream_chunk_len = len;
+   if (mprotect(code, MEMBLOCK_ALIGN, PROT_READ|PROT_EXEC) != 0)
+   {
+      perror("mprotect");
+      exit(1);
+   }
+   __builtin___clear_cache((char *)code, (char *)code + len);
+
+   if (ismaster
+       && (send_data_pkt(master_socket, &len, sizeof(len))
+           || send_data_pkt(master_socket, code, len)))
+   {
+      fprintf(stderr, "apprentice didn't accept chunk %u\n", stream_chunk);
+      exit(1);
+   }
+}
+
+void next_chunk(void *uc)
+{
+   load_next_chunk();
+   set_pc(uc, image_start_address);
+}
+
+static void map_image_part(void *addr, size_t len, int prot,
+                           int fd, off_t offset)
+{
+   /* Map part of an image file in place, without copying it */
+   if (mmap(addr, len, prot, MAP_PRIVATE|MAP_FIXED, fd, offset) == MAP_FAILED)
+   {
+      perror("mmap");
+      exit(1);
+   }
+   note_mapped(addr, len, prot);
+}
+
+static void load_container(const char *imgfile, int fd,
+                           const uint8_t *file, size_t len)
+{
+   struct risu_image_header hdr;
+   struct risu_image_section sect;
+   const uint8_t *sections = file + sizeof(hdr);
+   size_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+   size_t extent = 0;
+   uint8_t *addr;
+   uint32_t i, npatterns = 0;
+   int prot, have_code = 0;
+
+   memcpy(&hdr, file, sizeof(hdr));
+   if (hdr.version != RISU_IMAGE_VERSION)
+   {
+      bad_image(imgfile, "unknown version");
+   }
+#ifdef RISU_HOST_ARCH
+   if (hdr.arch != RISU_HOST_ARCH)
+   {
+      bad_image(imgfile, "it is for another architecture");
+   }
+#endif
+   if (hdr.nsections > (len - sizeof(hdr)) / sizeof(sect))
+   {
+      bad_image(imgfile, "section table is truncated");
+   }
+
+   /* Check the sections, and find out how much space the ones
+    * which are mapped need, before mapping anything.
+    */
+   for (i = 0; i < hdr.nsections; i++)
+   {
+      memcpy(&sect, sections + i * sizeof(sect), sizeof(sect));
+      if (sect.offset > len || sect.size > len - sect.offset)
+      {
+         bad_image(imgfile, "section is outside the file");
+      }
+      if (!sect.prot)
+      {
+         continue;
+      }
+      if ((sect.offset | sect.addr) & pagemask)
+      {
+         bad_image(imgfile, "mapped section is not page aligned");
+      }
+      if (sect.addr > len - sect.size)
+      {
+         bad_image(imgfile, "mapped section is too far from the code");
+      }
+      if (sect.type == RISU_SECTION_CODE)
+      {
+         if (sect.addr != 0 || !(sect.prot & RISU_SECTION_EXEC))
+         {
+            bad_image(imgfile, "code section is not executable at 0");
+         }
+         have_code = 1;
+      }
+      if (sect.addr + sect.size > extent)
+      {
+         extent = sect.addr + sect.size;
+      }
+   }
+   if (!have_code)
+   {
+      bad_image(imgfile, "no code section");
+   }
+
+   /* Map the code and data straight from the file, and keep
+    * pointers into the file for the rest.
+    */
+   addr = reserve_image(extent);
+   for (i = 0; i < hdr.nsections; i++)
+   {
+      memcpy(&sect, sections + i * sizeof(sect), sizeof(sect));
+      if (sect.prot && sect.size)
+      {
+         prot = (sect.prot & RISU_SECTION_READ ? PROT_READ : 0)
+            | (sect.prot & RISU_SECTION_WRITE ? PROT_WRITE : 0)
+            | (sect.prot & RISU_SECTION_EXEC ? PROT_EXEC : 0);
+         map_image_part(addr + sect.addr, sect.size, prot, fd, sect.offset);
+         continue;
+      }
+      switch (sect.type)
+      {
+         case RISU_SECTION_INDEX:
+            image_index = (const uint32_t *)(file + sect.offset);
+            num_image_index = sect.size / 8;
+            break;
+         case RISU_SECTION_NAMES:
+            image_names = (const char *)(file + sect.offset);
+            image_names_len = sect.size;
+            break;
+         case RISU_SECTION_CHECKPOINTS:
+            image_checkpoints = (const uint32_t *)(file + sect.offset);
+            num_image_checkpoints = sect.size / 8;
+            break;
+      }
+   }
+   for (i = 0; i < image_names_len; i++)
+   {
+      npatterns += image_names[i] == 0;
+   }
+   fprintf(stderr, "%u test insns from %u patterns\n",
+           num_image_index, npatterns);
+}
+
+static void load_map(const char *imgfile)
+{
+   /* The map is optional, and only used for reports, so if
+    * there's anything wrong with it we just do without.
+    */
+   struct risu_map_header hdr;
+   const struct risu_map_entry *e;
+   const uint8_t *file;
+   struct stat st;
+   size_t len;
+   uint32_t i;
+   char *fname = malloc(strlen(imgfile) + 5);
+   int fd;
+
+   sprintf(fname, "%s.map", imgfile);
+   fd = open(fname, O_RDONLY);
+   if (fd < 0)
+   {
+      free(fname);
+      return;
+   }
+   if (fstat(fd, &st) != 0)
+   {
+      perror("fstat");
+      exit(1);
+   }
+   len = st.st_size;
+   file = len ? mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+   close(fd);
+   if (file == MAP_FAILED || len < sizeof(hdr))
+   {
+      goto bad;
+   }
+   memcpy(&hdr, file, sizeof(hdr));
+   if (memcmp(hdr.magic, RISU_MAP_MAGIC, 8) != 0
+       || hdr.version != RISU_MAP_VERSION
+       || hdr.nentries > (len - sizeof(hdr)) / sizeof(*e)
+       || hdr.strtab_len != len - sizeof(hdr) - hdr.nentries * sizeof(*e)
+       || hdr.strtab_len == 0 || file[len - 1] != 0)
+   {
+      goto bad;
+   }
+   e = (const struct risu_map_entry *)(file + sizeof(hdr));
+   for (i = 0; i < hdr.nentries; i++)
+   {
+      if (image_len < 4 || e[i].offset > image_len - 4 || (i && e[i].offset <= e[i - 1].offset)
+          || e[i].name >= hdr.strtab_len || e[i].fields >= hdr.strtab_len)
+      {
+         goto bad;
+      }
+   }
+   image_map = e;
+   num_image_map = hdr.nentries;
+   image_map_strings = (const char *)(e + hdr.nentries);
+   free(fname);
+   return;
+
+ bad:
+   fprintf(stderr, "ignoring bad map %s\n", fname);
+   if (file != MAP_FAILED)
+   {
+      munmap((void *)file, len);
+   }
+   free(fname);
+}
+
+static const char *pattern_name(uint32_t n)
+{
+   /* The nth of the container's pattern names */
+   const char *p = image_names, *end = image_names + image_names_len;
+   const char *nul;
+   for (;;)
+   {
+      nul = p < end ? memchr(p, 0, end - p) : 0;
+      if (!nul || !n--)
+      {
+         return nul ? p : 0;
+      }
+      p = nul + 1;
+   }
+}
+
+static int find_test_insn(uint64_t pc, uint32_t *offset,
+                          const char **name, const char **fields)
+{
+   /* Binary search the map (or, failing that, the container index)
+    * for the last test insn at or before pc. Returns 1 if we found
+    * it, with *fields 0 if we only know the pattern, 0 if not and -1
+    * if the map doesn't go with the image.
+    */
+   const struct risu_map_entry *e;
+   uint32_t lo = 0, hi = num_image_map, mid;
+
+   if (!num_image_map)
+   {
+      hi = num_image_index;
+      while (lo < hi)
+      {
+         mid = lo + (hi - lo) / 2;
+         if (image_index[2 * mid] <= pc)
+         {
+            lo = mid + 1;
+         }
+         else
+         {
+            hi = mid;
+         }
+      }
+      *name = lo ? pattern_name(image_index[2 * (lo - 1) + 1]) : 0;
+      if (!*name)
+      {
+         return 0;
+      }
+      *offset = image_index[2 * (lo - 1)];
+      *fields = 0;
+      return 1;
+   }
+
+   while (lo < hi)
+   {
+      mid = lo + (hi - lo) / 2;
+      if (image_map[mid].offset <= pc)
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   if (!lo)
+   {
+      return 0;
+   }
+   e = &image_map[lo - 1];
+   if (memcmp((uint8_t *)image_start + e->offset, e->insn, 4) != 0)
+   {
+      return -1;
+   }
+   *offset = e->offset;
+   *name = image_map_strings + e->name;
+   *fields = image_map_strings + e->fields;
+   return 1;
+}
+
+int locate_test_insn(uint64_t pc, uint32_t *offset, const char **name)
+{
+   const char *fields;
+   return find_test_insn(pc, offset, name, &fields) == 1;
+}
+
+void report_test_insn(FILE *f, uint64_t pc)
+{
+   const char *name, *enc, *fields;
+   uint32_t offset;
+
+   switch (find_test_insn(pc, &offset, &name, &fields))
+   {
+      case 0:
+         return;
+      case -1:
+         fprintf(f, "  (the image's map doesn't match it)\n");
+         return;
+   }
+   if (!fields)
+   {
+      fprintf(f, "  test insn at pc offset %#" PRIx32 ": pattern %s\n",
+              offset, name);
+      return;
+   }
+   enc = strrchr(name, ' ');
+   fprintf(f, "  test insn at pc offset %#" PRIx32 ": pattern %.*s, "
+           "encoding %s, fields %s\n", offset,
+           enc ? (int)(enc - name) : (int)strlen(name), name,
+           enc ? enc + 1 : "?", fields);
+}
+
+/* --mismatch-log: the file the master appends a record of each
+ * mismatch to, or -1
+ */
+static int mismatch_log_fd = -1;
+static __thread char *mismatch_record;
+static __thread size_t mismatch_record_len;
+
+FILE *start_mismatch_record(uint32_t insn, uintptr_t pc, int memory)
+{
+   const char *name, *fields;
+   uint32_t offset;
+   FILE *f;
+
+   if (mismatch_log_fd < 0)
+   {
+      return 0;
+   }
+   f = open_memstream(&mismatch_record, &mismatch_record_len);
+   if (!f)
+   {
+      return 0;
+   }
+   fprintf(f, "time=%lld\timage=%s\thash=%016" PRIx64 "\tpc=%#" PRIxPTR
+           "\tinsn=%08x\tkind=%s", (long long)time(0), thread_image,
+           image_hash, pc, insn, memory ? "memory" : "regs");
+   if (image_stream)
+   {
+      fprintf(f, "\tchunk=%u", stream_chunk);
+   }
+   if (find_test_insn(pc, &offset, &name, &fields) == 1)
+   {
+      fprintf(f, "\tpattern=%s", name);
+      if (fields)
+      {
+         fprintf(f, "\tfields=%s", fields);
+      }
+   }
+   fprintf(f, "\tdiffs=");
+   return f;
+}
+
+void end_mismatch_record(FILE *f)
+{
+   /* One write per record, so that several risus can share the file */
+   if (!f)
+   {
+      return;
+   }
+   fputc('\n', f);
+   if (fclose(f) == 0
+       && write(mismatch_log_fd, mismatch_record, mismatch_record_len)
+          != (ssize_t)mismatch_record_len)
+   {
+      perror("writing mismatch log");
+   }
+   free(mismatch_record);
+   mismatch_record = 0;
+}
+
+void write_memblock_diffs(FILE *f, const void *m, const void *a)
+{
+   /* The 64 bit words which differ, named by their offset in the
+    * block (which needn't be aligned, for an old image's own block)
+    */
+   uint64_t mw, aw;
+   int i, n = 0;
+   for (i = 0; i < MEMBLOCKLEN; i += 8)
+   {
+      memcpy(&mw, (const uint8_t *)m + i, 8);
+      memcpy(&aw, (const uint8_t *)a + i, 8);
+      if (mw != aw)
+      {
+         fprintf(f, "%smem+%#x=%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64,
+                 n++ ? " " : "", i, mw, aw, mw ^ aw);
+      }
+   }
+}
+
+static void load_elf(const char *imgfile, int fd,
+                     const uint8_t *file, size_t len)
+{
+   /* An ELF image as written by risugen --format elf: we map its
+    * PT_LOAD segments just like the sections of a container, and
+    * look for a .risu.checkpoints section.
+    */
+   const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *)file;
+   const ElfW(Phdr) *ph;
+   const ElfW(Shdr) *sh, *shstr;
+   size_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+   size_t extent = 0;
+   uint8_t *addr;
+   int i, prot, have_code = 0;
+
+   if (len < sizeof(*eh)
+       || eh->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32)
+       || eh->e_ident[EI_DATA] != ELFDATA2LSB
+       || (eh->e_type != ET_EXEC && eh->e_type != ET_DYN))
+   {
+      bad_image(imgfile, "not an ELF executable for this host");
+   }
+#ifdef RISU_HOST_EM
+   if (eh->e_machine != RISU_HOST_EM)
+   {
+      bad_image(imgfile, "it is for another architecture");
+   }
+#endif
+   if (eh->e_phentsize != sizeof(*ph) || eh->e_phoff > len
+       || eh->e_phnum > (len - eh->e_phoff) / sizeof(*ph))
+   {
+      bad_image(imgfile, "program headers are outside the file");
+   }
+
+   ph = (const ElfW(Phdr) *)(file + eh->e_phoff);
+   for (i = 0; i < eh->e_phnum; i++)
+   {
+      if (ph[i].p_type != PT_LOAD)
+      {
+         continue;
+      }
+      if (ph[i].p_offset > len || ph[i].p_filesz > len - ph[i].p_offset)
+      {
+         bad_image(imgfile, "segment is outside the file");
+      }
+      if (ph[i].p_memsz != ph[i].p_filesz)
+      {
+         bad_image(imgfile, "segment has a bss");
+      }
+      if ((ph[i].p_offset | ph[i].p_vaddr) & pagemask)
+      {
+         bad_image(imgfile, "segment is not page aligned");
+      }
+      if (ph[i].p_vaddr > len - ph[i].p_memsz)
+      {
+         bad_image(imgfile, "segment is too far from the code");
+      }
+      if (ph[i].p_vaddr == 0 && (ph[i].p_flags & PF_X))
+      {
+         have_code = 1;
+      }
+      if (ph[i].p_vaddr + ph[i].p_memsz > extent)
+      {
+         extent = ph[i].p_vaddr + ph[i].p_memsz;
+      }
+   }
+   if (!have_code || eh->e_entry >= extent)
+   {
+      bad_image(imgfile, "no executable segment at 0 to start at");
+   }
+
+   addr = reserve_image(extent);
+   image_entry = (entrypoint_fn *)(addr + eh->e_entry);
+   for (i = 0; i < eh->e_phnum; i++)
+   {
+      if (ph[i].p_type == PT_LOAD && ph[i].p_memsz)
+      {
+         prot = (ph[i].p_flags & PF_R ? PROT_READ : 0)
+            | (ph[i].p_flags & PF_W ? PROT_WRITE : 0)
+            | (ph[i].p_flags & PF_X ? PROT_EXEC : 0);
+         map_image_part(addr + ph[i].p_vaddr, ph[i].p_memsz, prot,
+                        fd, ph[i].p_offset);
+      }
+   }
+   /* For gdb's add-symbol-file -o */
+   fprintf(stderr, "image mapped at %p\n", addr);
+
+   /* The section headers are optional */
+   if (!eh->e_shoff || eh->e_shentsize != sizeof(*sh) || eh->e_shoff > len
+       || eh->e_shnum > (len - eh->e_shoff) / sizeof(*sh)
+       || eh->e_shstrndx >= eh->e_shnum)
    {
-      perror("sigaction");
-      exit(1);
+      return;
+   }
+   sh = (const ElfW(Shdr) *)(file + eh->e_shoff);
+   shstr = &sh[eh->e_shstrndx];
+   if (shstr->sh_offset > len || shstr->sh_size > len - shstr->sh_offset)
+   {
+      return;
+   }
+   for (i = 0; i < eh->e_shnum; i++)
+   {
+      if (sh[i].sh_name < shstr->sh_size
+          && shstr->sh_size - sh[i].sh_name > strlen(".risu.checkpoints")
+          && strcmp((const char *)file + shstr->sh_offset + sh[i].sh_name,
+                    ".risu.checkpoints") == 0
+          && sh[i].sh_offset <= len && sh[i].sh_size <= len - sh[i].sh_offset)
+      {
+         image_checkpoints = (const uint32_t *)(file + sh[i].sh_offset);
+         num_image_checkpoints = sh[i].sh_size / 8;
+      }
    }
 }
 
-typedef void entrypoint_fn(void);
-
-uintptr_t image_start_address;
-entrypoint_fn *image_start;
-
 void load_image(const char *imgfile)
 {
-   /* Load image file into memory as executable */
+   /* Load image file into memory as executable: either a container
+    * as written by risugen --format risu, an ELF file, or a raw image.
+    */
    struct stat st;
+   const uint8_t *file;
    fprintf(stderr, "loading test image %s...\n", imgfile);
+   if (strcmp(imgfile, "-") == 0)
+   {
+      load_stream();
+      return;
+   }
    int fd = open(imgfile, O_RDONLY);
    if (fd < 0)
    {
@@ -105,55 +1394,493 @@ void load_image(const char *imgfile)
       exit(1);
    }
    size_t len = st.st_size;
-   void *addr;
 
-   /* Map writable because we include the memory area for store
-    * testing in the image.
+   /* We keep the whole file mapped to read the parts of it
+    * which aren't mapped for running.
     */
-   addr = mmap(0, len, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE, fd, 0);
-   if (!addr)
+   file = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+   if (file == MAP_FAILED)
    {
       perror("mmap");
       exit(1);
    }
+   image_hash = hash_bytes(file, len);
+
+   if (len >= sizeof(struct risu_image_header)
+       && memcmp(file, RISU_IMAGE_MAGIC, 8) == 0)
+   {
+      load_container(imgfile, fd, file, len);
+   }
+   else if (len >= SELFMAG && memcmp(file, ELFMAG, SELFMAG) == 0)
+   {
+      load_elf(imgfile, fd, file, len);
+   }
+   else
+   {
+      load_raw_image(fd, file, len);
+   }
    close(fd);
-   image_start = addr;
-   image_start_address = (uintptr_t)addr;
+   load_map(imgfile);
+}
+
+static void report_header(FILE *f)
+{
+   /* Reports from different threads mustn't get mixed up:
+    * the caller should be holding the lock on f.
+    */
+   if (nthreads > 1)
+   {
+      fprintf(f, "thread %d (%s):\n", thread_index, thread_image);
+   }
+}
+
+static void find_checkpoint(const char *imgfile, long index)
+{
+   /* Set image_entry to the last checkpoint at or before test insn
+    * index, from the image's table of (insn index, offset) pairs.
+    */
+   const uint32_t *table = image_checkpoints;
+   uint32_t n = num_image_checkpoints, i, best = 0;
+
+   if (n == 0)
+   {
+      fprintf(stderr, "%s has no checkpoints "
+              "(generate it with risugen --checkpoints)\n", imgfile);
+      exit(1);
+   }
+   for (i = 0; i < n && table[2 * i] <= index; i++)
+   {
+      best = i;
+   }
+   fprintf(stderr, "starting at checkpoint before insn %u\n", table[2 * best]);
+   image_entry = (entrypoint_fn *)((uint8_t *)image_start + table[2 * best + 1]);
 }
 
 int master(int sock)
 {
    if (sigsetjmp(jmpbuf, 1))
    {
-      return report_match_status();
+      int resp;
+      flockfile(stderr);
+      report_header(stderr);
+      if (image_stream)
+      {
+         fprintf(stderr, "in chunk %u of the image stream\n", stream_chunk);
+      }
+      resp = report_match_status();
+      resp = report_mismatch_summary() || resp;
+      funlockfile(stderr);
+      return resp;
    }
    master_socket = sock;
+   if (image_stream)
+   {
+      load_next_chunk();
+   }
    set_sigill_handler(&master_sigill);
    fprintf(stderr, "starting image\n");
-   image_start();
+   image_entry();
    fprintf(stderr, "image returned unexpectedly\n");
    exit(1);
 }
 
 int apprentice(int sock)
 {
+   if (sigsetjmp(jmpbuf, 1))
+   {
+      return apprentice_status;
+   }
    apprentice_socket = sock;
+   if (image_stream)
+   {
+      load_next_chunk();
+   }
    set_sigill_handler(&apprentice_sigill);
    fprintf(stderr, "starting image\n");
-   image_start();
+   image_entry();
    fprintf(stderr, "image returned unexpectedly\n");
    exit(1);
 }
 
-int ismaster;
+static int bench_cmp(const void *a, const void *b)
+{
+   const struct bench_region *ra = a, *rb = b;
+   if (!ra->name || !rb->name)
+   {
+      return !ra->name - !rb->name;
+   }
+   return strcmp(ra->name, rb->name);
+}
+
+static void bench_print(struct bench_region *r)
+{
+   double secs = r->ns / 1e9;
+   printf("%-32s %10" PRIu64 " %12" PRIu64 " %10.6f %10.3f\n",
+          r->name, r->regions, r->insns, secs,
+          secs ? r->insns / secs / 1e6 : 0.0);
+}
+
+static int bench_report(void)
+{
+   /* Pattern names are "insnname encname": report per pattern
+    * and then summed per encoding, of which there can't be more
+    * than there are patterns (plus a terminating empty slot).
+    */
+   struct bench_region *r, *e, *end = bench_names + BENCH_MAX_NAMES;
+   struct bench_region *enc = calloc(BENCH_MAX_NAMES + 1, sizeof(*enc));
+
+   if (!enc)
+   {
+      perror("calloc");
+      return 1;
+   }
+   qsort(bench_names, BENCH_MAX_NAMES, sizeof(*r), bench_cmp);
+
+   printf("%-32s %10s %12s %10s %10s\n",
+          "pattern", "regions", "insns", "seconds", "Minsns/s");
+   for (r = bench_names; r < end && r->name; r++)
+   {
+      const char *encname = strrchr(r->name, ' ');
+      if (!*r->name)
+      {
+         continue;
+      }
+      bench_print(r);
+
+      encname = encname ? encname + 1 : r->name;
+      for (e = enc; e->name; e++)
+      {
+         if (strcmp(e->name, encname) == 0)
+         {
+            break;
+         }
+      }
+      e->name = encname;
+      e->regions += r->regions;
+      e->insns += r->insns;
+      e->ns += r->ns;
+   }
+
+   if (bench_overflow.regions)
+   {
+      /* Not attributed to any pattern or encoding */
+      fprintf(stderr, "more than %d region names: the rest are "
+              "counted as %s\n", BENCH_MAX_NAMES, bench_overflow.name);
+      bench_print(&bench_overflow);
+   }
+
+   printf("\n%-32s %10s %12s %10s %10s\n",
+          "encoding", "regions", "insns", "seconds", "Minsns/s");
+   for (e = enc; e->name; e++)
+   {
+      bench_print(e);
+   }
+   free(enc);
+
+   printf("\ntotal %.6f seconds, %" PRIu64 " traps\n",
+          ns_between(&bench_total_start, &bench_start) / 1e9, bench_traps);
+   return 0;
+}
+
+int bench_image(void)
+{
+   if (sigsetjmp(jmpbuf, 1))
+   {
+      int resp;
+      flockfile(stdout);
+      report_header(stdout);
+      resp = bench_report();
+      funlockfile(stdout);
+      return resp;
+   }
+   if (image_stream)
+   {
+      load_next_chunk();
+   }
+   set_sigill_handler(&bench_sigill);
+   fprintf(stderr, "starting image\n");
+   clock_gettime(CLOCK_MONOTONIC, &bench_total_start);
+   bench_start = bench_total_start;
+   image_entry();
+   fprintf(stderr, "image returned unexpectedly\n");
+   exit(1);
+}
+
+/* --spawn starts the apprentice with its ends of the connections as
+ * fds SPAWN_FD onwards, which it is told with --fd.
+ */
+#define SPAWN_FD 3
+
+static void start_apprentice(const char *cmd, struct risu_thread *threads,
+                             char **images, int nimages)
+{
+   /* Pass on the images, and the options which have to be the
+    * same at both ends.
+    */
+   char **args = calloc(nimages + 12, sizeof(char *));
+   char fdstr[16], threadstr[16], startstr[32], timeoutstr[32], runstr[32];
+   int *socks = calloc(nthreads, sizeof(int));
+   int i, n = 0;
+
+   sprintf(fdstr, "%d", SPAWN_FD);
+   args[n++] = "--fd";
+   args[n++] = fdstr;
+   if (nthreads > 1)
+   {
+      sprintf(threadstr, "%d", nthreads);
+      args[n++] = "--threads";
+      args[n++] = threadstr;
+   }
+   if (start_at)
+   {
+      sprintf(startstr, "%ld", start_at);
+      args[n++] = "--start-at";
+      args[n++] = startstr;
+   }
+   if (test_fp_exc)
+   {
+      args[n++] = "--test-fp-exc";
+   }
+   /* The apprentice mustn't wait on a master which has given up */
+   if (comms_timeout)
+   {
+      sprintf(timeoutstr, "%g", comms_timeout / 1000.0);
+      args[n++] = "--timeout";
+      args[n++] = timeoutstr;
+   }
+   if (run_deadline)
+   {
+      sprintf(runstr, "%g", (run_deadline - monotonic_ms()) / 1000.0);
+      args[n++] = "--run-timeout";
+      args[n++] = runstr;
+   }
+   for (i = 0; i < nimages; i++)
+   {
+      args[n++] = images[i];
+   }
+
+   fprintf(stderr, "spawning apprentice: %s\n", cmd);
+   apprentice_pid = spawn_apprentice(cmd, args, nthreads, SPAWN_FD, socks);
+   atexit(kill_apprentice);
+   for (i = 0; i < nthreads; i++)
+   {
+      threads[i].fd = socks[i];
+   }
+   free(socks);
+   free(args);
+}
+
+static int wait_for_apprentice(pid_t pid)
+{
+   /* The master has the last word on whether the test passed,
+    * but an apprentice which went wrong shouldn't go unnoticed.
+    */
+   int wstatus;
+   if (waitpid(pid, &wstatus, 0) < 0)
+   {
+      perror("waitpid");
+      return 1;
+   }
+   apprentice_pid = 0;
+   if (WIFSIGNALED(wstatus))
+   {
+      fprintf(stderr, "apprentice killed by signal %d\n", WTERMSIG(wstatus));
+      return 1;
+   }
+   if (WEXITSTATUS(wstatus) != 0)
+   {
+      fprintf(stderr, "apprentice exited with status %d\n",
+              WEXITSTATUS(wstatus));
+      return 1;
+   }
+   return 0;
+}
+
+/* Why the master refused a connection, as the response to the
+ * apprentice's hello
+ */
+static const char *const hello_mismatch[] = {
+   0,
+   "protocol version",
+   "architecture",
+   "register layout",
+   "memory block size",
+   "image",
+   "--test-fp-exc or --start-at",
+};
+
+static void init_hello(struct risu_hello *h)
+{
+   memset(h, 0, sizeof(*h));
+   memcpy(h->magic, RISU_HELLO_MAGIC, sizeof(RISU_HELLO_MAGIC));
+   h->version = RISU_PROTOCOL_VERSION;
+#ifdef RISU_HOST_ARCH
+   h->arch = RISU_HOST_ARCH;
+#endif
+   h->reginfo_layout = hash_bytes((const uint8_t *)reginfo_layout,
+                                  reginfo_layout_len * sizeof(uint32_t));
+   h->image_hash = image_hash;
+   h->memblocklen = MEMBLOCKLEN;
+   h->features = RISU_FEATURES;
+   h->test_fp_exc = test_fp_exc;
+   h->start_at = start_at;
+}
+
+static int compare_hello(struct risu_hello *m, struct risu_hello *a)
+{
+   /* Returns the index into hello_mismatch[] of the first thing
+    * that stops the two ends being compared, or 0 if nothing does.
+    */
+   if (memcmp(m->magic, a->magic, sizeof(m->magic)) != 0
+       || m->version != a->version)
+   {
+      return 1;
+   }
+   if (m->arch != a->arch)
+   {
+      return 2;
+   }
+   if (m->reginfo_layout != a->reginfo_layout)
+   {
+      return 3;
+   }
+   if (m->memblocklen != a->memblocklen)
+   {
+      return 4;
+   }
+   if (m->image_hash != a->image_hash)
+   {
+      return 5;
+   }
+   if (m->test_fp_exc != a->test_fp_exc || m->start_at != a->start_at)
+   {
+      return 6;
+   }
+   return 0;
+}
+
+static void send_hello(int sock)
+{
+   /* The apprentice's side of the handshake: send our hello, and
+    * get back either why the master won't go on or the features
+    * we both support.
+    */
+   struct risu_hello h;
+   int resp;
+
+   init_hello(&h);
+   resp = send_data_pkt(sock, &h, sizeof(h));
+   if (resp != 0)
+   {
+      fprintf(stderr, "can't compare with the master: different %s\n",
+              resp < sizeof(hello_mismatch) / sizeof(hello_mismatch[0])
+              && hello_mismatch[resp]
+              ? hello_mismatch[resp] : "protocol version");
+      exit(1);
+   }
+   if (recv_data_pkt(sock, &features, sizeof(features)))
+   {
+      fprintf(stderr, "failed to read features from master\n");
+      exit(1);
+   }
+   send_response_byte(sock, 0);
+}
+
+static void check_hello(int sock)
+{
+   /* The master's side: check the apprentice's hello against ours,
+    * and tell it which of the optional features to use.
+    */
+   struct risu_hello m, a;
+   int why;
+
+   init_hello(&m);
+   /* A hello of another size can only be from another version */
+   why = recv_data_pkt(sock, &a, sizeof(a)) ? 1 : compare_hello(&m, &a);
+   send_response_byte(sock, why);
+   if (why)
+   {
+      fprintf(stderr, "can't compare with the apprentice: different %s\n",
+              hello_mismatch[why]);
+      exit(1);
+   }
+   features = m.features & a.features;
+   if (max_mismatches && !(features & RISU_FEATURE_RESYNC))
+   {
+      fprintf(stderr, "the apprentice can't carry on after a mismatch, "
+              "so stopping at the first\n");
+   }
+   if (send_data_pkt(sock, &features, sizeof(features)) != 0)
+   {
+      fprintf(stderr, "apprentice didn't accept features\n");
+      exit(1);
+   }
+}
+
+static int run_image(struct risu_thread *t)
+{
+   int sock;
+
+   this_thread = t;
+   thread_index = t->index;
+   thread_image = t->imgfile;
+   load_image(t->imgfile);
+   if (start_at)
+   {
+      find_checkpoint(t->imgfile, start_at);
+   }
+
+   if (bench)
+   {
+      return bench_image();
+   }
+   else if (ismaster)
+   {
+      if (t->fd >= 0)
+      {
+         sock = t->fd;
+      }
+      else
+      {
+         fprintf(stderr, "master port %d\n", t->port);
+         sock = master_connect(t->port);
+      }
+      check_hello(sock);
+      return master(sock);
+   }
+   else
+   {
+      if (t->fd >= 0)
+      {
+         sock = t->fd;
+      }
+      else
+      {
+         fprintf(stderr, "apprentice host %s port %d\n",
+                 t->hostname, t->port);
+         sock = apprentice_connect(t->hostname, t->port);
+      }
+      send_hello(sock);
+      return apprentice(sock);
+   }
+}
+
+static void *thread_fn(void *arg)
+{
+   struct risu_thread *t = arg;
+   t->status = run_image(t);
+   return 0;
+}
 
 int main(int argc, char **argv)
 {
    // some handy defaults to make testing easier
    uint16_t port = 9191;
    char *hostname = "localhost";
-   char *imgfile;
-   int sock;
+   struct risu_thread *threads;
+   int i, nimages, status = 0;
+   const char *spawn_cmd = 0;
+   int fd = -1;
 
    // TODO clean this up later
    
@@ -162,9 +1889,19 @@ int main(int argc, char **argv)
       static struct option longopts[] = 
          {
             { "master", no_argument, &ismaster, 1 },
+            { "bench", no_argument, &bench, 1 },
             { "host", required_argument, 0, 'h' },
             { "port", required_argument, 0, 'p' },
+            { "max-mismatches", required_argument, 0, 'm' },
+            { "mismatch-log", required_argument, 0, 'M' },
+            { "timeout", required_argument, 0, 't' },
+            { "run-timeout", required_argument, 0, 'T' },
+            { "threads", required_argument, 0, 'j' },
+            { "start-at", required_argument, 0, 's' },
+            { "spawn", required_argument, 0, 'S' },
+            { "fd", required_argument, 0, 'f' },
             { "test-fp-exc", no_argument, &test_fp_exc, 1 },
+            { "memblock-hugepages", no_argument, &memblock_hugepages, 1 },
             { 0,0,0,0 }
          };
       int optidx = 0;
@@ -192,6 +1929,51 @@ int main(int argc, char **argv)
             port = strtol(optarg, 0, 10);
             break;
          }
+         case 'm':
+         {
+            max_mismatches = strtol(optarg, 0, 10);
+            break;
+         }
+         case 'M':
+         {
+            mismatch_log_fd = open(optarg, O_WRONLY|O_APPEND|O_CREAT, 0644);
+            if (mismatch_log_fd < 0)
+            {
+               perror(optarg);
+               exit(1);
+            }
+            break;
+         }
+         case 't':
+         {
+            comms_timeout = strtod(optarg, 0) * 1000;
+            break;
+         }
+         case 'T':
+         {
+            run_deadline = monotonic_ms() + strtod(optarg, 0) * 1000;
+            break;
+         }
+         case 'j':
+         {
+            nthreads = strtol(optarg, 0, 10);
+            break;
+         }
+         case 's':
+         {
+            start_at = strtol(optarg, 0, 10);
+            break;
+         }
+         case 'S':
+         {
+            spawn_cmd = optarg;
+            break;
+         }
+         case 'f':
+         {
+            fd = strtol(optarg, 0, 10);
+            break;
+         }
          case '?':
          {
             /* error message printed by getopt_long */
@@ -202,27 +1984,85 @@ int main(int argc, char **argv)
       }
    }
 
-   imgfile = argv[optind];
-   if (!imgfile)
+   /* Either one image for all the threads, or one each */
+   nimages = argc - optind;
+   if (!nimages)
    {
       fprintf(stderr, "must specify image file name\n");
       exit(1);
    }
+   if (nimages > 1 && nthreads == 1)
+   {
+      nthreads = nimages;
+   }
+   if (nthreads < 1 || (nimages != 1 && nimages != nthreads))
+   {
+      fprintf(stderr, "must specify one image, or one for each thread\n");
+      exit(1);
+   }
 
-   load_image(imgfile);
-   
-   if (ismaster)
+   /* There's only one stdin to stream an image from */
+   for (i = 0; i < nimages; i++)
    {
-      fprintf(stderr, "master port %d\n", port);
-      sock = master_connect(port);
-      return master(sock);
+      if (strcmp(argv[optind + i], "-") == 0 && (nthreads > 1 || start_at))
+      {
+         fprintf(stderr, "a streamed image can't be run with "
+                 "--threads or --start-at\n");
+         exit(1);
+      }
+   }
+
+   threads = risu_threads = calloc(nthreads, sizeof(*threads));
+   for (i = 0; i < nthreads; i++)
+   {
+      threads[i].index = i;
+      threads[i].imgfile = argv[optind + (nimages == 1 ? 0 : i)];
+      threads[i].hostname = hostname;
+      threads[i].port = port + i;
+      threads[i].fd = fd >= 0 ? fd + i : -1;
+   }
+
+   if (run_deadline)
+   {
+      start_run_timer();
+   }
+
+   if (spawn_cmd)
+   {
+      if (!ismaster || fd >= 0)
+      {
+         fprintf(stderr, "--spawn is only for the master, without --fd\n");
+         exit(1);
+      }
+      start_apprentice(spawn_cmd, threads, argv + optind, nimages);
+   }
+
+   if (nthreads == 1)
+   {
+      status = run_image(&threads[0]);
    }
    else
    {
-      fprintf(stderr, "apprentice host %s port %d\n", hostname, port);
-      sock = apprentice_connect(hostname, port);
-      return apprentice(sock);
+      for (i = 0; i < nthreads; i++)
+      {
+         if (pthread_create(&threads[i].thread, 0, thread_fn, &threads[i]))
+         {
+            fprintf(stderr, "failed to create thread %d\n", i);
+            exit(1);
+         }
+      }
+      for (i = 0; i < nthreads; i++)
+      {
+         pthread_join(threads[i].thread, 0);
+         status |= threads[i].status;
+      }
+   }
+
+   if (apprentice_pid)
+   {
+      status |= wait_for_apprentice(apprentice_pid);
    }
+   return status;
 }
 
    
@@ -13,6 +13,8 @@
 #define RISU_H
 
 #include <inttypes.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 #include "config.h"
 
@@ -31,31 +33,278 @@ int send_data_pkt(int sock, void *pkt, int pktlen);
 int recv_data_pkt(int sock, void *pkt, int pktlen);
 void send_response_byte(int sock, int resp);
 
-extern uintptr_t image_start_address;
-extern void *memblock;
+/* Fork and exec the shell command cmd with args (a NULL-terminated
+ * list) appended, connected to us by nsocks socket pairs: their other
+ * ends are fds fdbase onwards in the child, and ours go in socks.
+ * Returns the child's pid.
+ */
+pid_t spawn_apprentice(const char *cmd, char **args,
+                       int nsocks, int fdbase, int *socks);
+
+/* Deadlines for the socket routines, in milliseconds: how long to wait
+ * for the other end in any one operation, and the CLOCK_MONOTONIC time
+ * by which the whole run must be over. 0 means no limit.
+ */
+extern int comms_timeout;
+extern int64_t run_deadline;
+int64_t monotonic_ms(void);
+
+/* Called by the socket routines when a deadline passes: reports
+ * how far we got and exits with EXIT_TIMEOUT. Doesn't return.
+ */
+void comms_timed_out(void);
+
+/* Exit status for a stalled test, as for timeout(1) */
+#define EXIT_TIMEOUT 124
+
+/* The state of the test image a thread is running (see --threads) */
+extern __thread uintptr_t image_start_address;
+extern __thread size_t image_len;
+extern __thread void *memblock;
+
+/* Fill the memory block from the seed given by OP_SEEDMEMBLOCK
+ * and start using it for load/store tests.
+ */
+void seed_memblock(uint32_t seed);
+
+/* Use a memory block embedded at addr in the image itself
+ * (OP_SETMEMBLOCK, as generated by older versions of risugen).
+ */
+void set_image_memblock(void *addr);
 
 extern int test_fp_exc;
 
+/* The fault signal (SIGSEGV, SIGBUS or SIGFPE) being handled, or
+ * 0 for SIGILL, its si_code and the faulting address, as returned
+ * by normalise_address(). For reginfo_init().
+ */
+extern __thread int fault_signal, fault_code;
+extern __thread uint64_t fault_addr;
+
+/* Turn an address in the image or memory block into an offset from
+ * the start of the image, so that it doesn't depend on where they
+ * were mapped. Other addresses are left alone.
+ */
+uint64_t normalise_address(uintptr_t addr);
+
+/* Whether the len bytes at addr are in the parts of the image or
+ * memory block which are mapped readable, and so safe to read: a pc
+ * can end up anywhere after a bad branch.
+ */
+int image_contains(uintptr_t addr, size_t len);
+
+/* Called by the master on a mismatch at pc (an offset into the image)
+ * after the test insn insn (see test_insn() in the arch code). Records
+ * it under the pattern the insn came from, or failing that the insn,
+ * for the summary printed at the end and returns nonzero if we are still within the --max-mismatches
+ * budget, in which case the master logs the mismatch and sends its
+ * state to the apprentice (response code 3) and both carry on.
+ */
+int continue_after_mismatch(uint32_t insn, uintptr_t pc, int memory);
+
+/* With --mismatch-log the master appends a line to the log for each
+ * mismatch: tab-separated key=value fields saying where it was and,
+ * after "diffs=", a space-separated name=master,apprentice,xor for
+ * each value which differed (see risu-mismatches). The arch code
+ * starts the record, which returns NULL if there is no log, writes
+ * the diffs to it and ends it. Called from the signal handler, but
+ * like continue_after_mismatch() can use stdio.
+ */
+FILE *start_mismatch_record(uint32_t insn, uintptr_t pc, int memory);
+void end_mismatch_record(FILE *f);
+void write_memblock_diffs(FILE *f, const void *m, const void *a);
+
 /* Ops code under test can request from risu: */
 #define OP_COMPARE 0
 #define OP_TESTEND 1
 #define OP_SETMEMBLOCK 2
 #define OP_GETMEMBLOCK 3
 #define OP_COMPAREMEM 4
+#define OP_SEEDMEMBLOCK 5
+#define OP_MARKER 6
+#define OP_FASTCHECK 7
+#define OP_REGPROFILE 8
+#define OP_NEXTCHUNK 9
+
+/* OP_MARKER starts a new region for --bench. It is followed by a
+ * branch over its payload: a 32 bit count of the insns in the region
+ * and then the NUL-terminated name of the region.
+ */
+
+/* Images generated with risugen --fast-trap do their OP_COMPARE and
+ * OP_COMPAREMEM by calling fast_trap_entry (whose address risu puts at
+ * the start of the page MEMBLOCK_ALIGN after the memory block) with
+ * x30 saved on the stack, followed by the risuop, which the stub skips.
+ * Now and then they follow that with OP_FASTCHECK, an UNDEF which
+ * checks that the stub saw the same state as the signal handler does.
+ */
+
+/* OP_REGPROFILE says which registers the image's tests can change, and
+ * so which of them need capturing and sending at each compare: one of
+ * the RISU_REGS_* in r0/x0. risugen --reg-profile puts one at the start
+ * of the image and at each checkpoint. Without one it is the full set.
+ */
+#define RISU_REGS_FULL 0   /* everything */
+#define RISU_REGS_FP 1     /* no SIMD: just the low 64 bits of each vreg */
+#define RISU_REGS_GPR 2    /* no FP/SIMD state at all */
+
+extern __thread int reg_profile;
+
+/* Set reg_profile from an OP_REGPROFILE. Exits on one we don't know. */
+void set_reg_profile(uint64_t profile);
+
+/* risugen --stream writes an image as a stream of chunks for risu to
+ * run as they arrive, rather than a file: "RISUSTRM", then for each
+ * chunk its length as a little-endian uint32_t and the chunk, a raw
+ * image of at most MEMBLOCK_ALIGN bytes. Each chunk is run in the same
+ * place, so the memory block is where each expects, and each but the
+ * last ends with OP_NEXTCHUNK (in ARM mode), which loads the next over
+ * it and jumps to its start. risu reads a stream from stdin when the
+ * image is given as "-", and the master passes each chunk on to the
+ * apprentice, which is also given "-", so that both run the same code.
+ */
+#define RISU_STREAM_MAGIC "RISUSTRM"
+
+/* OP_NEXTCHUNK: load the next chunk of the stream and set the PC in
+ * the ucontext to its start. Called from the signal handler.
+ */
+void next_chunk(void *uc);
+
+/* Called by the fast trap stub with a ucontext it has filled in with
+ * the registers, just as for a SIGILL at the risuop, and which it then
+ * reloads them from.
+ */
+void fast_trap(void *uc);
 
 /* The memory block should be this long */
 #define MEMBLOCKLEN 8192
 
+/* risu maps the memory block at the end of the image rounded up to
+ * this, so generated code can address it PC-relative. Large enough
+ * to allow the block to live in a huge page.
+ */
+#define MEMBLOCK_ALIGN 0x200000
+
+/* risugen --format risu writes the image as a container: this header,
+ * then nsections section entries, then the sections themselves at the
+ * given file offsets, all little-endian. Sections with a nonzero prot
+ * are mapped at addr from the start of the image (the code section at
+ * 0, and the memory block goes after the last of them); the others
+ * just describe the image to risu. The raw format is the code and
+ * data alone.
+ */
+#define RISU_IMAGE_MAGIC "RISUIMG"
+#define RISU_IMAGE_VERSION 1
+
+#define RISU_IMAGE_ARCH_ARM 1
+#define RISU_IMAGE_ARCH_AARCH64 2
+
+#define RISU_SECTION_CODE 1        /* the test code */
+#define RISU_SECTION_DATA 2        /* its data, eg for --reg-table */
+#define RISU_SECTION_INDEX 3       /* (offset, pattern) words per test insn */
+#define RISU_SECTION_NAMES 4       /* NUL-terminated pattern names */
+#define RISU_SECTION_META 5        /* "key=value" lines: seed, args... */
+#define RISU_SECTION_CHECKPOINTS 6 /* (insn index, offset) words */
+
+#define RISU_SECTION_READ 1
+#define RISU_SECTION_WRITE 2
+#define RISU_SECTION_EXEC 4
+
+struct risu_image_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t arch;
+   uint32_t nsections;
+   uint32_t reserved;
+};
+
+struct risu_image_section {
+   uint32_t type;
+   uint32_t prot;
+   uint64_t offset;
+   uint64_t size;
+   uint64_t addr;
+};
+
+/* risugen also writes <image>.map, saying where each test insn came
+ * from: this header, then nentries entries in offset order, then
+ * strtab_len bytes of the NUL-terminated strings they refer to, all
+ * little-endian. The insn is a copy of the 4 bytes at the offset in
+ * the image, to check the map goes with it.
+ */
+#define RISU_MAP_MAGIC "RISUMAP"
+#define RISU_MAP_VERSION 1
+
+struct risu_map_header {
+   char magic[8];
+   uint32_t version;
+   uint32_t nentries;
+   uint32_t strtab_len;
+};
+
+struct risu_map_entry {
+   uint32_t offset;
+   uint8_t insn[4];
+   uint32_t name;      /* "insnname encname" of the pattern */
+   uint32_t fields;    /* "field=value ..." */
+};
+
+/* The first thing on a connection is a handshake: the apprentice sends
+ * a hello, which the master checks against its own. If anything means
+ * the two runs can't be compared it responds with why (an index into
+ * risu.c's hello_mismatch[]) and both give up; otherwise it responds 0
+ * and sends the RISU_FEATURE_* bits they both support as a uint32_t.
+ * Bump RISU_PROTOCOL_VERSION for any change to what goes over the
+ * connection.
+ */
+#define RISU_HELLO_MAGIC "RISUHI"
+#define RISU_PROTOCOL_VERSION 2
+
+#define RISU_FEATURE_RESYNC 1      /* carry on after a mismatch (resp 3) */
+#define RISU_FEATURES RISU_FEATURE_RESYNC
+
+struct risu_hello {
+   char magic[8];
+   uint32_t version;
+   uint32_t arch;             /* RISU_IMAGE_ARCH_*, or 0 */
+   uint64_t reginfo_layout;   /* hash of reginfo_layout[] */
+   uint64_t image_hash;
+   uint32_t memblocklen;
+   uint32_t features;
+   uint32_t test_fp_exc;
+   uint32_t reserved;
+   uint64_t start_at;
+};
+
+/* Print which pattern the test insn at or before pc (an offset into
+ * the image) was generated from, and its field values, if the image's
+ * map (or, failing that, its container index) says.
+ */
+void report_test_insn(FILE *f, uint64_t pc);
+
+/* The offset and pattern name of the test insn at or before pc, from
+ * the map or container index as for report_test_insn(). Returns 0 if
+ * the image has neither (or its map doesn't go with it).
+ */
+int locate_test_insn(uint64_t pc, uint32_t *offset, const char **name);
+
 /* Interface provided by CPU-specific code: */
 
 /* Send the register information from the struct ucontext down the socket.
- * Return the response code from the master.
+ * Return the response code from the master. For 3 (mismatch, but
+ * carry on) the master's state has already been copied into the
+ * ucontext and memory block, including its PC, so that both carry on
+ * past the same risuop. Returns 4 without asking the master if the
+ * PC has already been set (OP_NEXTCHUNK, or going on after a resync
+ * in the fast trap stub).
  * NB: called from a signal handler.
  */
 int send_register_info(int sock, void *uc);
 
 /* Read register info from the socket and compare it with that from the
- * ucontext. Return 0 for match, 1 for end-of-test, 2 for mismatch.
+ * ucontext. Return 0 for match, 1 for end-of-test, 2 for mismatch,
+ * 3 for a mismatch we have resynchronised the apprentice after,
+ * 4 if the risuop has set the PC (OP_NEXTCHUNK).
  * NB: called from a signal handler.
  */
 int recv_and_compare_register_info(int sock, void *uc);
@@ -72,4 +321,37 @@ int report_match_status(void);
  */
 void advance_pc(void *uc);
 
+/* Return the PC from the ucontext
+ */
+uintptr_t get_pc(void *uc);
+
+/* Set the PC in the ucontext to pc, in ARM rather than Thumb state
+ */
+void set_pc(void *uc, uintptr_t pc);
+
+/* Do whatever the risuop at the PC asks for in --bench mode, where
+ * there is no master to talk to, and return the op (or -1 for a
+ * non-risuop UNDEF). For OP_MARKER, set *payload to point to the
+ * marker's payload. Doesn't move the PC.
+ * NB: called from a signal handler.
+ */
+int bench_risuop(void *uc, void **payload);
+
+/* The offset and size of each field of struct reginfo, for the
+ * handshake, so that builds which would send different packets
+ * refuse to talk to each other.
+ */
+extern const uint32_t reginfo_layout[];
+extern const int reginfo_layout_len;
+
+/* How many bytes at the start of a struct reginfo are captured,
+ * compared and sent under the current reg_profile.
+ */
+size_t reginfo_size(void);
+
+/* The arch's fast trap stub (see fast_trap()), or NULL if it hasn't
+ * got one.
+ */
+extern void (*const fast_trap_entry)(void);
+
 #endif /* RISU_H */
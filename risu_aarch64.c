@@ -11,18 +11,23 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ucontext.h>
 #include <string.h>
 
 #include "risu.h"
 #include "risu_reginfo_aarch64.h"
 
-struct reginfo master_ri, apprentice_ri;
+/* Per-thread state, for --threads */
+__thread struct reginfo master_ri, apprentice_ri;
 
-uint8_t apprentice_memblock[MEMBLOCKLEN];
+__thread uint8_t apprentice_memblock[MEMBLOCKLEN];
 
-static int mem_used = 0;
-static int packet_mismatch = 0;
+static __thread int mem_used = 0;
+static __thread int packet_mismatch = 0;
+
+/* The state the last fast trap saw, for OP_FASTCHECK */
+static __thread struct reginfo fast_ri;
 
 void advance_pc(void *vuc)
 {
@@ -30,6 +35,18 @@ void advance_pc(void *vuc)
     uc->uc_mcontext.pc += 4;
 }
 
+uintptr_t get_pc(void *vuc)
+{
+    ucontext_t *uc = vuc;
+    return uc->uc_mcontext.pc;
+}
+
+void set_pc(void *vuc, uintptr_t pc)
+{
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.pc = pc;
+}
+
 static void set_x0(void *vuc, uint64_t x0)
 {
     ucontext_t *uc = vuc;
@@ -47,10 +64,286 @@ static int get_risuop(uint32_t insn)
     return (key != risukey) ? -1 : op;
 }
 
-int send_register_info(int sock, void *uc)
+static uint32_t test_insn(uint64_t pc)
+{
+    /* The insn under test, for the compare at pc: the image's map or
+     * index says where it is, since the insns just before the compare
+     * may be setting up the memory block or making a fast trap.
+     * Without either we can only go by the top byte (roughly, the
+     * opcode) of the insn before the compare.
+     */
+    uint32_t offset;
+    const char *name;
+
+    if (locate_test_insn(pc, &offset, &name)) {
+        return *(uint32_t *)(image_start_address + offset);
+    }
+    if (pc < 4) {
+        return 0;
+    }
+    return *(uint32_t *)(image_start_address + pc - 4) & 0xff000000;
+}
+
+/* The --fast-trap stub: called with x30 saved at [sp] and pointing at
+ * the risuop after the call. It saves the registers in a struct
+ * fast_regs on the stack, has risu_fast_trap_c() deal with them, and
+ * reloads them (including the saved x30) before returning past the
+ * risuop.
+ */
+struct fast_regs {
+    uint64_t regs[31];
+    uint64_t sp;
+    uint64_t pc;
+    uint64_t nzcv;
+    uint64_t fpsr;
+    uint64_t fpcr;
+    __uint128_t vregs[32];
+};
+
+void risu_fast_trap(void);
+void risu_fast_trap_c(struct fast_regs *r);
+
+/* Whether we are in risu_fast_trap_c(), and where it has to carry on
+ * after a resync which moved the pc somewhere the stub can't return
+ * to: the stub returns to its risuop instead, and the SIGILL handler
+ * goes on from there.
+ */
+static __thread int in_fast_trap;
+static __thread uint64_t fast_resume_pc, fast_resume_x30;
+
+static int is_fast_trap_risuop(uint64_t pc)
+{
+    /* Is there a --fast-trap risuop at pc, after its call? */
+    uint32_t *p = (uint32_t *)pc;
+    return pc - image_start_address >= 4
+        && pc - image_start_address < image_len
+        && p[-1] == 0xd63f03c0 && get_risuop(p[0]) >= 0;
+}
+
+asm(
+    "   .text\n"
+    "   .global risu_fast_trap\n"
+    "   .type risu_fast_trap, %function\n"
+    "risu_fast_trap:\n"
+    "   sub sp, sp, #800\n"
+    "   stp x0, x1, [sp, #0]\n"
+    "   stp x2, x3, [sp, #16]\n"
+    "   stp x4, x5, [sp, #32]\n"
+    "   stp x6, x7, [sp, #48]\n"
+    "   stp x8, x9, [sp, #64]\n"
+    "   stp x10, x11, [sp, #80]\n"
+    "   stp x12, x13, [sp, #96]\n"
+    "   stp x14, x15, [sp, #112]\n"
+    "   stp x16, x17, [sp, #128]\n"
+    "   stp x18, x19, [sp, #144]\n"
+    "   stp x20, x21, [sp, #160]\n"
+    "   stp x22, x23, [sp, #176]\n"
+    "   stp x24, x25, [sp, #192]\n"
+    "   stp x26, x27, [sp, #208]\n"
+    "   stp x28, x29, [sp, #224]\n"
+    /* x30 as the caller saved it, and sp before it did */
+    "   ldr x0, [sp, #800]\n"
+    "   add x1, sp, #816\n"
+    "   stp x0, x1, [sp, #240]\n"
+    "   mrs x1, nzcv\n"
+    "   stp x30, x1, [sp, #256]\n"
+    "   mrs x0, fpsr\n"
+    "   mrs x1, fpcr\n"
+    "   stp x0, x1, [sp, #272]\n"
+    "   add x0, sp, #288\n"
+    "   st1 {v0.2d, v1.2d, v2.2d, v3.2d}, [x0], #64\n"
+    "   st1 {v4.2d, v5.2d, v6.2d, v7.2d}, [x0], #64\n"
+    "   st1 {v8.2d, v9.2d, v10.2d, v11.2d}, [x0], #64\n"
+    "   st1 {v12.2d, v13.2d, v14.2d, v15.2d}, [x0], #64\n"
+    "   st1 {v16.2d, v17.2d, v18.2d, v19.2d}, [x0], #64\n"
+    "   st1 {v20.2d, v21.2d, v22.2d, v23.2d}, [x0], #64\n"
+    "   st1 {v24.2d, v25.2d, v26.2d, v27.2d}, [x0], #64\n"
+    "   st1 {v28.2d, v29.2d, v30.2d, v31.2d}, [x0], #64\n"
+    "   mov x0, sp\n"
+    "   bl risu_fast_trap_c\n"
+    "   add x0, sp, #288\n"
+    "   ld1 {v0.2d, v1.2d, v2.2d, v3.2d}, [x0], #64\n"
+    "   ld1 {v4.2d, v5.2d, v6.2d, v7.2d}, [x0], #64\n"
+    "   ld1 {v8.2d, v9.2d, v10.2d, v11.2d}, [x0], #64\n"
+    "   ld1 {v12.2d, v13.2d, v14.2d, v15.2d}, [x0], #64\n"
+    "   ld1 {v16.2d, v17.2d, v18.2d, v19.2d}, [x0], #64\n"
+    "   ld1 {v20.2d, v21.2d, v22.2d, v23.2d}, [x0], #64\n"
+    "   ld1 {v24.2d, v25.2d, v26.2d, v27.2d}, [x0], #64\n"
+    "   ld1 {v28.2d, v29.2d, v30.2d, v31.2d}, [x0], #64\n"
+    "   ldp x0, x1, [sp, #272]\n"
+    "   msr fpsr, x0\n"
+    "   msr fpcr, x1\n"
+    "   ldp x30, x1, [sp, #256]\n"
+    "   msr nzcv, x1\n"
+    /* where the caller reloads x30 from */
+    "   ldr x0, [sp, #240]\n"
+    "   str x0, [sp, #800]\n"
+    "   ldp x0, x1, [sp, #0]\n"
+    "   ldp x2, x3, [sp, #16]\n"
+    "   ldp x4, x5, [sp, #32]\n"
+    "   ldp x6, x7, [sp, #48]\n"
+    "   ldp x8, x9, [sp, #64]\n"
+    "   ldp x10, x11, [sp, #80]\n"
+    "   ldp x12, x13, [sp, #96]\n"
+    "   ldp x14, x15, [sp, #112]\n"
+    "   ldp x16, x17, [sp, #128]\n"
+    "   ldp x18, x19, [sp, #144]\n"
+    "   ldp x20, x21, [sp, #160]\n"
+    "   ldp x22, x23, [sp, #176]\n"
+    "   ldp x24, x25, [sp, #192]\n"
+    "   ldp x26, x27, [sp, #208]\n"
+    "   ldp x28, x29, [sp, #224]\n"
+    "   add sp, sp, #800\n"
+    "   add x30, x30, #4\n"
+    "   ret\n"
+    "   .size risu_fast_trap, . - risu_fast_trap\n"
+);
+
+void (*const fast_trap_entry)(void) = risu_fast_trap;
+
+void risu_fast_trap_c(struct fast_regs *r)
+{
+    /* Dress the registers up as the ucontext of a SIGILL at the
+     * risuop, so that the rest of risu can't tell the difference.
+     */
+    ucontext_t uc;
+    struct fpsimd_context *fp;
+    struct _aarch64_ctx *end;
+    int i;
+
+    uc.uc_mcontext.fault_address = 0;
+    for (i = 0; i < 31; i++) {
+        uc.uc_mcontext.regs[i] = r->regs[i];
+    }
+    uc.uc_mcontext.sp = r->sp;
+    uc.uc_mcontext.pc = r->pc;
+    uc.uc_mcontext.pstate = r->nzcv;
+
+    fp = (struct fpsimd_context *)&uc.uc_mcontext.__reserved[0];
+    fp->head.magic = FPSIMD_MAGIC;
+    fp->head.size = sizeof(*fp);
+    fp->fpsr = r->fpsr;
+    fp->fpcr = r->fpcr;
+    for (i = 0; i < 32; i++) {
+        fp->vregs[i] = r->vregs[i];
+    }
+    end = (struct _aarch64_ctx *)(fp + 1);
+    end->magic = 0;
+    end->size = 0;
+
+    in_fast_trap = 1;
+    fast_trap(&uc);
+    in_fast_trap = 0;
+
+    /* A resync can move the pc (see resync_pc()). If it's now past
+     * another fast trap's risuop, whose x30 is on the stack as ours
+     * is, we can just return there; otherwise go back to our risuop
+     * and have the SIGILL handler take it from there.
+     */
+    if (uc.uc_mcontext.pc != r->pc + 4) {
+        if (is_fast_trap_risuop(uc.uc_mcontext.pc - 4)) {
+            r->pc = uc.uc_mcontext.pc - 4;
+        } else {
+            fast_resume_pc = uc.uc_mcontext.pc;
+            fast_resume_x30 = uc.uc_mcontext.regs[30];
+            r->pc -= 4;
+        }
+    }
+
+    /* Take back anything a resync after a mismatch changed */
+    for (i = 0; i < 31; i++) {
+        r->regs[i] = uc.uc_mcontext.regs[i];
+    }
+    r->nzcv = uc.uc_mcontext.pstate & 0xf0000000;
+    r->fpsr = fp->fpsr;
+    r->fpcr = fp->fpcr;
+    for (i = 0; i < 32; i++) {
+        r->vregs[i] = fp->vregs[i];
+    }
+    reginfo_init(&fast_ri, &uc);
+}
+
+static void fast_check(void *uc)
+{
+    /* The only insn between the fast trap and this UNDEF restores
+     * x30, so apart from the pc the state should be the same.
+     */
+    struct reginfo ri;
+    reginfo_init(&ri, uc);
+    ri.pc = fast_ri.pc;
+    ri.faulting_insn = fast_ri.faulting_insn;
+    if (!reginfo_is_eq(&fast_ri, &ri)) {
+        fprintf(stderr, "fast trap and SIGILL disagree at pc offset %#"
+                PRIx64 "\n", ri.pc);
+        reginfo_dump_mismatch(&fast_ri, &ri, stderr);
+        exit(1);
+    }
+}
+
+static void send_resync(int sock)
 {
+    /* Give the apprentice our state to carry on from */
+    apprentice_ri = master_ri;
+    send_data_pkt(sock, &master_ri, reginfo_size());
+    if (memblock) {
+        memcpy(apprentice_memblock, memblock, MEMBLOCKLEN);
+        send_data_pkt(sock, memblock, MEMBLOCKLEN);
+    }
+}
+
+static void resync_pc(ucontext_t *uc, uint64_t pc)
+{
+    /* Carry on from the master's pc (the caller advances past it), so
+     * that after an insn which UNDEFs or faults on only one side we
+     * aren't a compare behind. Going on past a fast trap's risuop
+     * from the SIGILL handler, push x30 as its call would have done,
+     * for the insn after it to pop.
+     */
+    uint64_t target = image_start_address + pc;
+    if (!in_fast_trap && is_fast_trap_risuop(target)) {
+        uc->uc_mcontext.sp -= 16;
+        *(uint64_t *)uc->uc_mcontext.sp = uc->uc_mcontext.regs[30];
+    }
+    uc->uc_mcontext.pc = target;
+}
+
+static void recv_resync(int sock, void *uc)
+{
+    /* Take the master's state after a mismatch */
     struct reginfo ri;
-    int op;
+    if (recv_data_pkt(sock, &ri, reginfo_size())) {
+        fprintf(stderr, "bad resync packet from master\n");
+        exit(1);
+    }
+    send_response_byte(sock, 0);
+    reginfo_update(&ri, uc);
+    resync_pc(uc, ri.pc);
+    if (memblock) {
+        if (recv_data_pkt(sock, memblock, MEMBLOCKLEN)) {
+            fprintf(stderr, "bad resync packet from master\n");
+            exit(1);
+        }
+        send_response_byte(sock, 0);
+    }
+}
+
+int send_register_info(int sock, void *vuc)
+{
+    ucontext_t *uc = vuc;
+    struct reginfo ri;
+    int op, resp = 0;
+
+    if (fast_resume_pc) {
+        /* The fast trap stub came back to its risuop after a resync
+         * (see risu_fast_trap_c()): drop the x30 its call pushed and
+         * go on from where the master is.
+         */
+        uc->uc_mcontext.pc = fast_resume_pc;
+        uc->uc_mcontext.regs[30] = fast_resume_x30;
+        uc->uc_mcontext.sp += 16;
+        fast_resume_pc = 0;
+        return 4;
+    }
     reginfo_init(&ri, uc);
     op = get_risuop(ri.faulting_insn);
 
@@ -61,18 +354,65 @@ int send_register_info(int sock, void *uc)
         /* Do a simple register compare on (a) explicit request
          * (b) end of test (c) a non-risuop UNDEF
          */
-        return send_data_pkt(sock, &ri, sizeof(ri));
+        resp = send_data_pkt(sock, &ri, reginfo_size());
+        break;
     case OP_SETMEMBLOCK:
-        memblock = (void *)ri.regs[0];
-       break;
+        set_image_memblock((void *)ri.regs[0]);
+        break;
+    case OP_SEEDMEMBLOCK:
+        seed_memblock(ri.regs[0]);
+        break;
+    case OP_MARKER:
+        /* only of interest to --bench */
+        break;
+    case OP_FASTCHECK:
+        fast_check(uc);
+        break;
+    case OP_REGPROFILE:
+        set_reg_profile(ri.regs[0]);
+        break;
+    case OP_NEXTCHUNK:
+        next_chunk(uc);
+        resp = 4;
+        break;
     case OP_GETMEMBLOCK:
         set_x0(uc, ri.regs[0] + (uintptr_t)memblock);
         break;
     case OP_COMPAREMEM:
-        return send_data_pkt(sock, memblock, MEMBLOCKLEN);
+        resp = send_data_pkt(sock, memblock, MEMBLOCKLEN);
+        break;
+    }
+    if (resp == 3) {
+        recv_resync(sock, uc);
+    }
+    return resp;
+}
+
+int bench_risuop(void *vuc, void **payload)
+{
+    ucontext_t *uc = vuc;
+    uint64_t x0 = uc->uc_mcontext.regs[0];
+    int op = get_risuop(*(uint32_t *)uc->uc_mcontext.pc);
+
+    switch (op) {
+    case OP_MARKER:
+        /* skip the risuop and the branch over the payload */
+        *payload = (void *)(uc->uc_mcontext.pc + 8);
+        break;
+    case OP_SETMEMBLOCK:
+        set_image_memblock((void *)x0);
+        break;
+    case OP_SEEDMEMBLOCK:
+        seed_memblock(x0);
+        break;
+    case OP_REGPROFILE:
+        set_reg_profile(x0);
+        break;
+    case OP_GETMEMBLOCK:
+        set_x0(uc, x0 + (uintptr_t)memblock);
         break;
     }
-    return 0;
+    return op;
 }
 
 /* Read register info from the socket and compare it with that from the
@@ -97,13 +437,23 @@ int recv_and_compare_register_info(int sock, void *uc)
         /* Do a simple register compare on (a) explicit request
          * (b) end of test (c) a non-risuop UNDEF
          */
-        if (recv_data_pkt(sock, &apprentice_ri, sizeof(apprentice_ri))) {
+        if (recv_data_pkt(sock, &apprentice_ri, reginfo_size())) {
             packet_mismatch = 1;
             resp = 2;
 
         } else if (!reginfo_is_eq(&master_ri, &apprentice_ri)) {
             /* register mismatch */
+            uint32_t insn = test_insn(master_ri.pc);
+            FILE *rec = start_mismatch_record(insn, master_ri.pc, 0);
+            if (rec) {
+                reginfo_write_diffs(&master_ri, &apprentice_ri, rec);
+                end_mismatch_record(rec);
+            }
             resp = 2;
+            if (continue_after_mismatch(insn, master_ri.pc, 0)) {
+                reginfo_dump_mismatch(&master_ri, &apprentice_ri, stderr);
+                resp = 3;
+            }
 
         } else if (op == OP_TESTEND) {
             resp = 1;
@@ -111,7 +461,22 @@ int recv_and_compare_register_info(int sock, void *uc)
         send_response_byte(sock, resp);
         break;
       case OP_SETMEMBLOCK:
-          memblock = (void *)master_ri.regs[0];
+          set_image_memblock((void *)master_ri.regs[0]);
+          break;
+      case OP_SEEDMEMBLOCK:
+          seed_memblock(master_ri.regs[0]);
+          break;
+      case OP_MARKER:
+          break;
+      case OP_FASTCHECK:
+          fast_check(uc);
+          break;
+      case OP_REGPROFILE:
+          set_reg_profile(master_ri.regs[0]);
+          break;
+      case OP_NEXTCHUNK:
+          next_chunk(uc);
+          resp = 4;
           break;
       case OP_GETMEMBLOCK:
           set_x0(uc, master_ri.regs[0] + (uintptr_t)memblock);
@@ -123,12 +488,24 @@ int recv_and_compare_register_info(int sock, void *uc)
              resp = 2;
          } else if (memcmp(memblock, apprentice_memblock, MEMBLOCKLEN) != 0) {
              /* memory mismatch */
+             uint32_t insn = test_insn(master_ri.pc);
+             FILE *rec = start_mismatch_record(insn, master_ri.pc, 1);
+             if (rec) {
+                 write_memblock_diffs(rec, memblock, apprentice_memblock);
+                 end_mismatch_record(rec);
+             }
              resp = 2;
+             if (continue_after_mismatch(insn, master_ri.pc, 1)) {
+                 resp = 3;
+             }
          }
          send_response_byte(sock, resp);
          break;
    }
 
+    if (resp == 3) {
+        send_resync(sock);
+    }
     return resp;
 }
 
@@ -150,9 +527,10 @@ int report_match_status(void)
         */
        fprintf(stderr, "master reginfo:\n");
        reginfo_dump(&master_ri, stderr);
+       report_test_insn(stderr, master_ri.pc);
        return 1;
    }
-   if (memcmp(&master_ri, &apprentice_ri, sizeof(master_ri)) != 0)
+   if (!reginfo_is_eq(&master_ri, &apprentice_ri))
    {
        fprintf(stderr, "mismatch on regs!\n");
        resp = 1;
@@ -172,5 +550,6 @@ int report_match_status(void)
    reginfo_dump(&apprentice_ri, stderr);
 
    reginfo_dump_mismatch(&master_ri, &apprentice_ri, stderr);
+   report_test_insn(stderr, master_ri.pc);
    return resp;
 }
@@ -10,17 +10,22 @@
  *******************************************************************************/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <ucontext.h>
 #include <string.h>
 
 #include "risu.h"
 #include "risu_reginfo_arm.h"
 
-struct reginfo master_ri, apprentice_ri;
-uint8_t apprentice_memblock[MEMBLOCKLEN];
+/* Per-thread state, for --threads */
+__thread struct reginfo master_ri, apprentice_ri;
+__thread uint8_t apprentice_memblock[MEMBLOCKLEN];
 
-static int mem_used = 0;
-static int packet_mismatch = 0;
+static __thread int mem_used = 0;
+static __thread int packet_mismatch = 0;
+
+/* risugen --fast-trap is only for aarch64 */
+void (*const fast_trap_entry)(void) = 0;
 
 int insnsize(ucontext_t *uc)
 {
@@ -52,6 +57,19 @@ void advance_pc(void *vuc)
    uc->uc_mcontext.arm_pc += insnsize(uc);
 }
 
+uintptr_t get_pc(void *vuc)
+{
+   ucontext_t *uc = vuc;
+   return uc->uc_mcontext.arm_pc;
+}
+
+void set_pc(void *vuc, uintptr_t pc)
+{
+   ucontext_t *uc = vuc;
+   uc->uc_mcontext.arm_pc = pc;
+   uc->uc_mcontext.arm_cpsr &= ~0x20; /* T bit */
+}
+
 static void set_r0(void *vuc, uint32_t r0)
 {
    ucontext_t *uc = vuc;
@@ -69,11 +87,102 @@ static int get_risuop(uint32_t insn, int isz)
    return (key != risukey) ? -1 : op;
 }
 
+static uint32_t test_insn(ucontext_t *uc, uint64_t pc)
+{
+   /* The insn under test, for the compare at pc: the image's map or
+    * index says where it is, since the insns just before the compare
+    * may be setting up the memory block. Like reginfo_init() we put
+    * the first halfword of a 32 bit Thumb insn in the bottom half.
+    * Without a map or index we can only go by the opcode bits of the
+    * insn before the compare (in Thumb, guessing its size from the
+    * halfword before that).
+    */
+   uint32_t offset;
+   const char *name;
+   int found = locate_test_insn(pc, &offset, &name);
+   uint16_t *hw;
+
+   if (!found && pc < 4)
+   {
+      return 0;
+   }
+   if (!(uc->uc_mcontext.arm_cpsr & 0x20))
+   {
+      if (found)
+      {
+         return *(uint32_t *)(image_start_address + offset);
+      }
+      return *(uint32_t *)(image_start_address + pc - 4) & 0x0ff00000;
+   }
+   if (found)
+   {
+      hw = (uint16_t *)(image_start_address + offset);
+      switch (hw[0] & 0xF800)
+      {
+         case 0xE800:
+         case 0xF000:
+         case 0xF800:
+            return hw[0] | (hw[1] << 16);
+         default:
+            return hw[0];
+      }
+   }
+   hw = (uint16_t *)(image_start_address + pc);
+   switch (hw[-2] & 0xF800)
+   {
+      case 0xE800:
+      case 0xF000:
+      case 0xF800:
+         return hw[-2] & 0xfff0;
+      default:
+         return hw[-1] & 0xfe00;
+   }
+}
+
+static void send_resync(int sock)
+{
+   /* Give the apprentice our state to carry on from */
+   apprentice_ri = master_ri;
+   send_data_pkt(sock, &master_ri, reginfo_size());
+   if (memblock)
+   {
+      memcpy(apprentice_memblock, memblock, MEMBLOCKLEN);
+      send_data_pkt(sock, memblock, MEMBLOCKLEN);
+   }
+}
+
+static void recv_resync(int sock, void *vuc)
+{
+   /* Take the master's state after a mismatch */
+   ucontext_t *uc = vuc;
+   struct reginfo ri;
+   if (recv_data_pkt(sock, &ri, reginfo_size()))
+   {
+      fprintf(stderr, "bad resync packet from master\n");
+      exit(1);
+   }
+   send_response_byte(sock, 0);
+   reginfo_update(&ri, uc);
+   /* Carry on from the master's pc (the caller advances past it), so
+    * that after an insn which UNDEFs or faults on only one side we
+    * aren't a compare behind.
+    */
+   uc->uc_mcontext.arm_pc = image_start_address + ri.gpreg[15];
+   if (memblock)
+   {
+      if (recv_data_pkt(sock, memblock, MEMBLOCKLEN))
+      {
+         fprintf(stderr, "bad resync packet from master\n");
+         exit(1);
+      }
+      send_response_byte(sock, 0);
+   }
+}
 
 int send_register_info(int sock, void *uc)
 {
    struct reginfo ri;
-   int op;
+   int op, resp = 0;
    reginfo_init(&ri, uc);
    op = get_risuop(ri.faulting_insn, ri.faulting_insn_size);
 
@@ -85,18 +194,78 @@ int send_register_info(int sock, void *uc)
          /* Do a simple register compare on (a) explicit request
           * (b) end of test (c) a non-risuop UNDEF
           */
-         return send_data_pkt(sock, &ri, sizeof(ri));
+         resp = send_data_pkt(sock, &ri, reginfo_size());
+         break;
       case OP_SETMEMBLOCK:
-         memblock = (void *)ri.gpreg[0];
+         set_image_memblock((void *)ri.gpreg[0]);
+         break;
+      case OP_SEEDMEMBLOCK:
+         seed_memblock(ri.gpreg[0]);
+         break;
+      case OP_MARKER:
+         /* only of interest to --bench */
+         break;
+      case OP_REGPROFILE:
+         set_reg_profile(ri.gpreg[0]);
+         break;
+      case OP_NEXTCHUNK:
+         next_chunk(uc);
+         resp = 4;
          break;
       case OP_GETMEMBLOCK:
          set_r0(uc, ri.gpreg[0] + (uintptr_t)memblock);
          break;
       case OP_COMPAREMEM:
-         return send_data_pkt(sock, memblock, MEMBLOCKLEN);
+         resp = send_data_pkt(sock, memblock, MEMBLOCKLEN);
+         break;
+   }
+   if (resp == 3)
+   {
+      recv_resync(sock, uc);
+   }
+   return resp;
+}
+
+int bench_risuop(void *vuc, void **payload)
+{
+   ucontext_t *uc = vuc;
+   uint32_t r0 = uc->uc_mcontext.arm_r0;
+   int isz = insnsize(uc);
+   uint32_t insn;
+   int op;
+
+   if (isz == 2)
+   {
+      insn = *((uint16_t *)uc->uc_mcontext.arm_pc);
+   }
+   else
+   {
+      insn = *((uint32_t *)uc->uc_mcontext.arm_pc);
+   }
+   op = get_risuop(insn, isz);
+
+   switch (op)
+   {
+      case OP_MARKER:
+         /* skip the risuop and the branch over the payload,
+          * which is the same size as the risuop
+          */
+         *payload = (void *)(uc->uc_mcontext.arm_pc + 2 * isz);
+         break;
+      case OP_SETMEMBLOCK:
+         set_image_memblock((void *)r0);
+         break;
+      case OP_SEEDMEMBLOCK:
+         seed_memblock(r0);
+         break;
+      case OP_REGPROFILE:
+         set_reg_profile(r0);
+         break;
+      case OP_GETMEMBLOCK:
+         set_r0(uc, r0 + (uintptr_t)memblock);
          break;
    }
-   return 0;
+   return op;
 }
 
 /* Read register info from the socket and compare it with that from the
@@ -122,15 +291,27 @@ int recv_and_compare_register_info(int sock, void *uc)
          /* Do a simple register compare on (a) explicit request
           * (b) end of test (c) a non-risuop UNDEF
           */
-         if (recv_data_pkt(sock, &apprentice_ri, sizeof(apprentice_ri)))
+         if (recv_data_pkt(sock, &apprentice_ri, reginfo_size()))
          {
             packet_mismatch = 1;
             resp = 2;
          }
-         else if (memcmp(&master_ri, &apprentice_ri, sizeof(master_ri)) != 0)
+         else if (!reginfo_is_eq(&master_ri, &apprentice_ri))
          {
             /* register mismatch */
+            uint32_t insn = test_insn(uc, master_ri.gpreg[15]);
+            FILE *rec = start_mismatch_record(insn, master_ri.gpreg[15], 0);
+            if (rec)
+            {
+               reginfo_write_diffs(&master_ri, &apprentice_ri, rec);
+               end_mismatch_record(rec);
+            }
             resp = 2;
+            if (continue_after_mismatch(insn, master_ri.gpreg[15], 0))
+            {
+               reginfo_dump_mismatch(&master_ri, &apprentice_ri, stderr);
+               resp = 3;
+            }
          }
          else if (op == OP_TESTEND)
          {
@@ -139,7 +320,19 @@ int recv_and_compare_register_info(int sock, void *uc)
          send_response_byte(sock, resp);
          break;
       case OP_SETMEMBLOCK:
-         memblock = (void *)master_ri.gpreg[0];
+         set_image_memblock((void *)master_ri.gpreg[0]);
+         break;
+      case OP_SEEDMEMBLOCK:
+         seed_memblock(master_ri.gpreg[0]);
+         break;
+      case OP_MARKER:
+         break;
+      case OP_REGPROFILE:
+         set_reg_profile(master_ri.gpreg[0]);
+         break;
+      case OP_NEXTCHUNK:
+         next_chunk(uc);
+         resp = 4;
          break;
       case OP_GETMEMBLOCK:
          set_r0(uc, master_ri.gpreg[0] + (uintptr_t)memblock);
@@ -154,11 +347,26 @@ int recv_and_compare_register_info(int sock, void *uc)
          else if (memcmp(memblock, apprentice_memblock, MEMBLOCKLEN) != 0)
          {
             /* memory mismatch */
+            uint32_t insn = test_insn(uc, master_ri.gpreg[15]);
+            FILE *rec = start_mismatch_record(insn, master_ri.gpreg[15], 1);
+            if (rec)
+            {
+               write_memblock_diffs(rec, memblock, apprentice_memblock);
+               end_mismatch_record(rec);
+            }
             resp = 2;
+            if (continue_after_mismatch(insn, master_ri.gpreg[15], 1))
+            {
+               resp = 3;
+            }
          }
          send_response_byte(sock, resp);
          break;
    }
+   if (resp == 3)
+   {
+      send_resync(sock);
+   }
    return resp;
 }
 
@@ -181,6 +389,7 @@ int report_match_status(void)
        */
       fprintf(stderr, "master reginfo:\n");
       reginfo_dump(&master_ri, stderr);
+      report_test_insn(stderr, master_ri.gpreg[15]);
       return 1;
    }
    if (!reginfo_is_eq(&master_ri, &apprentice_ri))
@@ -205,5 +414,6 @@ int report_match_status(void)
    reginfo_dump(&apprentice_ri, stderr);
 
    reginfo_dump_mismatch(&master_ri, &apprentice_ri, stderr);
+   report_test_insn(stderr, master_ri.gpreg[15]);
    return resp;
 }
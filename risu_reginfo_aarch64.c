@@ -11,17 +11,56 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 
 #include "risu.h"
 #include "risu_reginfo_aarch64.h"
 
+#define FIELD(f) offsetof(struct reginfo, f), sizeof(((struct reginfo *)0)->f)
+
+const uint32_t reginfo_layout[] = {
+    sizeof(struct reginfo),
+    FIELD(fault_address), FIELD(fault_signal), FIELD(fault_code),
+    FIELD(regs), FIELD(sp), FIELD(pc), FIELD(flags), FIELD(faulting_insn),
+    FIELD(fpsr), FIELD(fpcr), FIELD(vregs),
+};
+const int reginfo_layout_len = sizeof(reginfo_layout) / sizeof(uint32_t);
+
+size_t reginfo_size(void)
+{
+    switch (reg_profile) {
+    case RISU_REGS_GPR:
+        return offsetof(struct reginfo, fpsr);
+    case RISU_REGS_FP:
+        return offsetof(struct reginfo, dregs) + 32 * sizeof(uint64_t);
+    default:
+        return sizeof(struct reginfo);
+    }
+}
+
+static struct fpsimd_context *find_fpsimd(ucontext_t *uc)
+{
+    struct _aarch64_ctx *ctx;
+    ctx = (struct _aarch64_ctx *)&uc->uc_mcontext.__reserved[0];
+
+    while (ctx->magic != FPSIMD_MAGIC && ctx->size != 0) {
+        ctx += (ctx->size + sizeof(*ctx) - 1) / sizeof(*ctx);
+    }
+
+    if (ctx->magic != FPSIMD_MAGIC
+        || ctx->size != sizeof(struct fpsimd_context)) {
+        fprintf(stderr, "risu_reginfo_aarch64: failed to get FP/SIMD state\n");
+        return NULL;
+    }
+    return (struct fpsimd_context *)ctx;
+}
+
 /* reginfo_init: initialize with a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc)
 {
     int i;
-    struct _aarch64_ctx *ctx;
     struct fpsimd_context *fp;
     /* necessary to be able to compare with memcmp later */
     memset(ri, 0, sizeof(*ri));
@@ -34,31 +73,68 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
     ri->flags = uc->uc_mcontext.pstate & 0xf0000000; /* get only flags */
 
     ri->fault_address = uc->uc_mcontext.fault_address;
-    ri->faulting_insn = *((uint32_t *)uc->uc_mcontext.pc);
-
-    ctx = (struct _aarch64_ctx *)&uc->uc_mcontext.__reserved[0];
-
-    while (ctx->magic != FPSIMD_MAGIC && ctx->size != 0) {
-        ctx += (ctx->size + sizeof(*ctx) - 1) / sizeof(*ctx);
+    if (fault_signal) {
+        ri->fault_signal = fault_signal;
+        ri->fault_code = fault_code;
+        ri->fault_address = fault_addr;
+    }
+    if (image_contains(uc->uc_mcontext.pc, 4)) {
+        ri->faulting_insn = *((uint32_t *)uc->uc_mcontext.pc);
     }
 
-    if (ctx->magic != FPSIMD_MAGIC || ctx->size != sizeof(*fp)) {
-        fprintf(stderr, "risu_reginfo_aarch64: failed to get FP/SIMD state\n");
+    if (reg_profile == RISU_REGS_GPR || !(fp = find_fpsimd(uc))) {
         return;
     }
-
-    fp = (struct fpsimd_context *)ctx;
     ri->fpsr = fp->fpsr;
     ri->fpcr = fp->fpcr;
 
-    for (i = 0; i < 32; i++)
-        ri->vregs[i] = fp->vregs[i];
+    if (reg_profile == RISU_REGS_FP) {
+        for (i = 0; i < 32; i++)
+            ri->dregs[i] = fp->vregs[i];
+    } else {
+        for (i = 0; i < 32; i++)
+            ri->vregs[i] = fp->vregs[i];
+    }
 };
 
+/* reginfo_update: write the state back to a ucontext.
+ * We leave sp alone, since it isn't compared. The pc is compared
+ * (as an offset into the image), but on a resync it is restored by
+ * recv_resync() in risu_aarch64.c, which knows where the image is.
+ */
+void reginfo_update(struct reginfo *ri, ucontext_t *uc)
+{
+    int i;
+    struct fpsimd_context *fp;
+
+    for (i = 0; i < 31; i++)
+        uc->uc_mcontext.regs[i] = ri->regs[i];
+
+    uc->uc_mcontext.pstate &= ~0xf0000000;
+    uc->uc_mcontext.pstate |= ri->flags;
+
+    /* and only the FP/SIMD state we captured */
+    if (reg_profile == RISU_REGS_GPR || !(fp = find_fpsimd(uc))) {
+        return;
+    }
+    fp->fpsr = ri->fpsr;
+    fp->fpcr = ri->fpcr;
+
+    if (reg_profile == RISU_REGS_FP) {
+        for (i = 0; i < 32; i++) {
+            fp->vregs[i] &= ~(__uint128_t)0xffffffffffffffff;
+            fp->vregs[i] |= ri->dregs[i];
+        }
+    } else {
+        for (i = 0; i < 32; i++)
+            fp->vregs[i] = ri->vregs[i];
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
-    return memcmp(r1, r2, sizeof(*r1)) == 0;
+    return memcmp(r1, r2, reginfo_size()) == 0;
 }
 
 /* reginfo_dump: print state to a stream, returns nonzero on success */
@@ -66,6 +142,10 @@ int reginfo_dump(struct reginfo *ri, FILE *f)
 {
     int i;
     fprintf(f, "  faulting insn %08x\n", ri->faulting_insn);
+    if (ri->fault_signal) {
+        fprintf(f, "  signal %d, si_code %d, address %016" PRIx64 "\n",
+                ri->fault_signal, ri->fault_code, ri->fault_address);
+    }
 
     for (i = 0; i < 31; i++)
         fprintf(f, "  X%2d   : %016" PRIx64 "\n", i, ri->regs[i]);
@@ -73,13 +153,21 @@ int reginfo_dump(struct reginfo *ri, FILE *f)
     fprintf(f, "  sp    : %016" PRIx64 "\n", ri->sp);
     fprintf(f, "  pc    : %016" PRIx64 "\n", ri->pc);
     fprintf(f, "  flags : %08x\n", ri->flags);
+    if (reg_profile == RISU_REGS_GPR) {
+        return !ferror(f);
+    }
     fprintf(f, "  fpsr  : %08x\n", ri->fpsr);
     fprintf(f, "  fpcr  : %08x\n", ri->fpcr);
 
-    for (i = 0; i < 32; i++)
-        fprintf(f, "  V%2d   : %016" PRIx64 "%016" PRIx64 "\n", i,
-                (uint64_t)(ri->vregs[i] >> 64),
-                (uint64_t)(ri->vregs[i] & 0xffffffffffffffff));
+    for (i = 0; i < 32; i++) {
+        if (reg_profile == RISU_REGS_FP) {
+            fprintf(f, "  D%2d   : %016" PRIx64 "\n", i, ri->dregs[i]);
+        } else {
+            fprintf(f, "  V%2d   : %016" PRIx64 "%016" PRIx64 "\n", i,
+                    (uint64_t)(ri->vregs[i] >> 64),
+                    (uint64_t)(ri->vregs[i] & 0xffffffffffffffff));
+        }
+    }
 
     return !ferror(f);
 }
@@ -93,6 +181,15 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
         fprintf(f, "  faulting insn mismatch %08x vs %08x\n",
                 m->faulting_insn, a->faulting_insn);
     }
+    if (m->fault_signal != a->fault_signal || m->fault_code != a->fault_code) {
+        fprintf(f, "  signal %d, si_code %d vs signal %d, si_code %d\n",
+                m->fault_signal, m->fault_code,
+                a->fault_signal, a->fault_code);
+    }
+    if (m->fault_address != a->fault_address) {
+        fprintf(f, "  fault address %016" PRIx64 " vs %016" PRIx64 "\n",
+                m->fault_address, a->fault_address);
+    }
     for (i = 0; i < 31; i++) {
         if (m->regs[i] != a->regs[i])
             fprintf(f, "  X%2d   : %016" PRIx64 " vs %016" PRIx64 "\n",
@@ -110,13 +207,23 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
     if (m->flags != a->flags)
         fprintf(f, "  flags : %08x vs %08x\n", m->flags, a->flags);
 
+    if (reg_profile == RISU_REGS_GPR) {
+        return !ferror(f);
+    }
+
     if (m->fpsr != a->fpsr)
         fprintf(f, "  fpsr  : %08x vs %08x\n", m->fpsr, a->fpsr);
 
     if (m->fpcr != a->fpcr)
         fprintf(f, "  fpcr  : %08x vs %08x\n", m->fpcr, a->fpcr);
 
-    for (i = 0; i < 32; i++) {
+    for (i = 0; i < 32 && reg_profile == RISU_REGS_FP; i++) {
+        if (m->dregs[i] != a->dregs[i])
+            fprintf(f, "  D%2d   : %016" PRIx64 " vs %016" PRIx64 "\n",
+                    i, m->dregs[i], a->dregs[i]);
+    }
+
+    for (i = 0; i < 32 && reg_profile == RISU_REGS_FULL; i++) {
         if (m->vregs[i] != a->vregs[i])
             fprintf(f, "  V%2d   : "
                     "%016" PRIx64 "%016" PRIx64 " vs "
@@ -129,3 +236,70 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 
     return !ferror(f);
 }
+
+static void write_diff(FILE *f, int *n, const char *name,
+                       uint64_t m, uint64_t a)
+{
+    fprintf(f, "%s%s=%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64,
+            (*n)++ ? " " : "", name, m, a, m ^ a);
+}
+
+void reginfo_write_diffs(struct reginfo *m, struct reginfo *a, FILE *f)
+{
+    char name[16];
+    int i, n = 0;
+    if (m->faulting_insn != a->faulting_insn) {
+        write_diff(f, &n, "insn", m->faulting_insn, a->faulting_insn);
+    }
+    if (m->fault_signal != a->fault_signal) {
+        write_diff(f, &n, "signal", m->fault_signal, a->fault_signal);
+    }
+    if (m->fault_code != a->fault_code) {
+        write_diff(f, &n, "si_code", m->fault_code, a->fault_code);
+    }
+    if (m->fault_address != a->fault_address) {
+        write_diff(f, &n, "fault_addr", m->fault_address, a->fault_address);
+    }
+    for (i = 0; i < 31; i++) {
+        if (m->regs[i] != a->regs[i]) {
+            sprintf(name, "x%d", i);
+            write_diff(f, &n, name, m->regs[i], a->regs[i]);
+        }
+    }
+    if (m->sp != a->sp) {
+        write_diff(f, &n, "sp", m->sp, a->sp);
+    }
+    if (m->pc != a->pc) {
+        write_diff(f, &n, "pc", m->pc, a->pc);
+    }
+    if (m->flags != a->flags) {
+        write_diff(f, &n, "flags", m->flags, a->flags);
+    }
+    if (reg_profile == RISU_REGS_GPR) {
+        return;
+    }
+    if (m->fpsr != a->fpsr) {
+        write_diff(f, &n, "fpsr", m->fpsr, a->fpsr);
+    }
+    if (m->fpcr != a->fpcr) {
+        write_diff(f, &n, "fpcr", m->fpcr, a->fpcr);
+    }
+    for (i = 0; i < 32 && reg_profile == RISU_REGS_FP; i++) {
+        /* named as the full set's low halves, so that they cluster */
+        if (m->dregs[i] != a->dregs[i]) {
+            sprintf(name, "v%d.lo", i);
+            write_diff(f, &n, name, m->dregs[i], a->dregs[i]);
+        }
+    }
+    for (i = 0; i < 32 && reg_profile == RISU_REGS_FULL; i++) {
+        /* each half on its own, so that each has its own mask */
+        if ((uint64_t)m->vregs[i] != (uint64_t)a->vregs[i]) {
+            sprintf(name, "v%d.lo", i);
+            write_diff(f, &n, name, m->vregs[i], a->vregs[i]);
+        }
+        if ((m->vregs[i] >> 64) != (a->vregs[i] >> 64)) {
+            sprintf(name, "v%d.hi", i);
+            write_diff(f, &n, name, m->vregs[i] >> 64, a->vregs[i] >> 64);
+        }
+    }
+}
@@ -16,21 +16,32 @@
 struct reginfo
 {
     uint64_t fault_address;
+    uint32_t fault_signal;
+    uint32_t fault_code;
     uint64_t regs[31];
     uint64_t sp;
     uint64_t pc;
     uint32_t flags;
     uint32_t faulting_insn;
 
-    /* FP/SIMD */
+    /* FP/SIMD: not captured at all for RISU_REGS_GPR, and for
+     * RISU_REGS_FP only the low halves, packed into dregs, so that
+     * what we send is just the start of the struct.
+     */
     uint32_t fpsr;
     uint32_t fpcr;
-    __uint128_t vregs[32];
+    union {
+        __uint128_t vregs[32];
+        uint64_t dregs[32];
+    };
 };
 
 /* initialize structure from a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc);
 
+/* Copy the register state in ri back into the ucontext */
+void reginfo_update(struct reginfo *ri, ucontext_t *uc);
+
 /* return 1 if structs are equal, 0 otherwise. */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2);
 
@@ -40,4 +51,7 @@ int reginfo_dump(struct reginfo *ri, FILE *f);
 /* reginfo_dump_mismatch: print mismatch details to a stream, ret nonzero=ok */
 int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f);
 
+/* write the fields which differ to a --mismatch-log record */
+void reginfo_write_diffs(struct reginfo *m, struct reginfo *a, FILE *f);
+
 #endif /* RISU_REGINFO_AARCH64_H */
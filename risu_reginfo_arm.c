@@ -11,6 +11,7 @@
  *****************************************************************************/
 
 #include <stdio.h>
+#include <stddef.h>
 #include <ucontext.h>
 #include <string.h>
 
@@ -19,6 +20,29 @@
 
 extern int insnsize(ucontext_t *uc);
 
+#define FIELD(f) offsetof(struct reginfo, f), sizeof(((struct reginfo *)0)->f)
+
+const uint32_t reginfo_layout[] = {
+   sizeof(struct reginfo),
+   FIELD(faulting_insn), FIELD(faulting_insn_size),
+   FIELD(gpreg), FIELD(cpsr),
+   FIELD(fault_signal), FIELD(fault_code), FIELD(fault_address),
+   FIELD(fpregs), FIELD(fpscr),
+};
+const int reginfo_layout_len = sizeof(reginfo_layout) / sizeof(uint32_t);
+
+/* There are no wider SIMD registers to leave out,
+ * so RISU_REGS_FP is the same as RISU_REGS_FULL.
+ */
+size_t reginfo_size(void)
+{
+   if (reg_profile == RISU_REGS_GPR)
+   {
+      return offsetof(struct reginfo, fpregs);
+   }
+   return sizeof(struct reginfo);
+}
+
 /* This is the data structure we pass over the socket.
  * It is a simplified and reduced subset of what can
  * be obtained with a ucontext_t*
@@ -120,20 +144,102 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc)
    // doesn't fill in enough fields yet.
    ri->cpsr = uc->uc_mcontext.arm_cpsr & 0xF80F0000;
 
-   ri->faulting_insn = *((uint16_t*)uc->uc_mcontext.arm_pc);
-   ri->faulting_insn_size = insnsize(uc);
-   if (ri->faulting_insn_size != 2)
+   /* Left as 0 if the pc is off in the weeds */
+   if (image_contains(uc->uc_mcontext.arm_pc, 4))
    {
-      ri->faulting_insn |= (*((uint16_t*)uc->uc_mcontext.arm_pc+1)) << 16;
+      ri->faulting_insn = *((uint16_t*)uc->uc_mcontext.arm_pc);
+      ri->faulting_insn_size = insnsize(uc);
+      if (ri->faulting_insn_size != 2)
+      {
+         ri->faulting_insn |= (*((uint16_t*)uc->uc_mcontext.arm_pc+1)) << 16;
+      }
    }
 
-   reginfo_init_vfp(ri, uc);
+   if (fault_signal)
+   {
+      ri->fault_signal = fault_signal;
+      ri->fault_code = fault_code;
+      ri->fault_address = fault_addr;
+   }
+
+   if (reg_profile != RISU_REGS_GPR)
+   {
+      reginfo_init_vfp(ri, uc);
+   }
+}
+
+static void reginfo_update_vfp(struct reginfo *ri, ucontext_t *uc)
+{
+   /* Write the VFP registers back to uc->uc_regspace:
+    * see reginfo_init_vfp() for the layout.
+    */
+   unsigned long *rs = uc->uc_regspace;
+
+   for (;;)
+   {
+      switch (*rs++)
+      {
+         case 0:
+            return;
+         case 0x56465001: /* VFP_MAGIC */
+         {
+            int i;
+            if (*rs < ((32*2)+1))
+            {
+               rs += (*rs / 4);
+               break;
+            }
+            rs++;
+            for (i = 0; i < 32; i++)
+            {
+               *rs++ = ri->fpregs[i];
+               *rs++ = ri->fpregs[i] >> 32;
+            }
+            /* Only update the bits we compare */
+            *rs = (*rs & ~0xffff9f9f) | ri->fpscr;
+            return;
+         }
+         default:
+            rs += (*rs / 4);
+            break;
+      }
+   }
+}
+
+/* reginfo_update: write the state back to a ucontext.
+ * We leave sp alone, since it isn't compared. The pc is compared
+ * (as an offset into the image), but on a resync it is restored by
+ * recv_resync() in risu_arm.c, which knows where the image is.
+ */
+void reginfo_update(struct reginfo *ri, ucontext_t *uc)
+{
+   uc->uc_mcontext.arm_r0 = ri->gpreg[0];
+   uc->uc_mcontext.arm_r1 = ri->gpreg[1];
+   uc->uc_mcontext.arm_r2 = ri->gpreg[2];
+   uc->uc_mcontext.arm_r3 = ri->gpreg[3];
+   uc->uc_mcontext.arm_r4 = ri->gpreg[4];
+   uc->uc_mcontext.arm_r5 = ri->gpreg[5];
+   uc->uc_mcontext.arm_r6 = ri->gpreg[6];
+   uc->uc_mcontext.arm_r7 = ri->gpreg[7];
+   uc->uc_mcontext.arm_r8 = ri->gpreg[8];
+   uc->uc_mcontext.arm_r9 = ri->gpreg[9];
+   uc->uc_mcontext.arm_r10 = ri->gpreg[10];
+   uc->uc_mcontext.arm_fp = ri->gpreg[11];
+   uc->uc_mcontext.arm_ip = ri->gpreg[12];
+   uc->uc_mcontext.arm_lr = ri->gpreg[14];
+   uc->uc_mcontext.arm_cpsr &= ~0xF80F0000;
+   uc->uc_mcontext.arm_cpsr |= ri->cpsr;
+
+   if (reg_profile != RISU_REGS_GPR)
+   {
+      reginfo_update_vfp(ri, uc);
+   }
 }
 
 /* reginfo_is_eq: compare the reginfo structs, returns nonzero if equal */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
-    return memcmp(r1, r2, sizeof(*r1)) == 0; /* ok since we memset 0 */
+    return memcmp(r1, r2, reginfo_size()) == 0; /* ok since we memset 0 */
 }
 
 /* reginfo_dump: print the state to a stream, returns nonzero on success */
@@ -144,11 +250,20 @@ int reginfo_dump(struct reginfo *ri, FILE *f)
       fprintf(f, "  faulting insn %04x\n", ri->faulting_insn);
    else
       fprintf(f, "  faulting insn %08x\n", ri->faulting_insn);
+   if (ri->fault_signal)
+   {
+      fprintf(f, "  signal %d, si_code %d, address %08x\n",
+              ri->fault_signal, ri->fault_code, ri->fault_address);
+   }
    for (i = 0; i < 16; i++)
    {
       fprintf(f, "  r%d: %08x\n", i, ri->gpreg[i]);
    }
    fprintf(f, "  cpsr: %08x\n", ri->cpsr);
+   if (reg_profile == RISU_REGS_GPR)
+   {
+      return !ferror(f);
+   }
    for (i = 0; i < 32; i++)
    {
       fprintf(f, "  d%d: %016llx\n",
@@ -177,6 +292,13 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a,
          fprintf(f, "  faulting insn mismatch %08x vs %08x\n",
                  m->faulting_insn, a->faulting_insn);
    }
+   if (m->fault_signal != a->fault_signal || m->fault_code != a->fault_code)
+      fprintf(f, "  signal %d, si_code %d vs signal %d, si_code %d\n",
+              m->fault_signal, m->fault_code,
+              a->fault_signal, a->fault_code);
+   if (m->fault_address != a->fault_address)
+      fprintf(f, "  fault address %08x vs %08x\n",
+              m->fault_address, a->fault_address);
    for (i = 0; i < 16; i++)
    {
       if (m->gpreg[i] != a->gpreg[i])
@@ -184,6 +306,10 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a,
    }
    if (m->cpsr != a->cpsr)
       fprintf(f, "  cpsr: %08x vs %08x\n", m->cpsr, a->cpsr);
+   if (reg_profile == RISU_REGS_GPR)
+   {
+      return !ferror(f);
+   }
    for (i = 0; i < 32; i++)
    {
       if (m->fpregs[i] != a->fpregs[i])
@@ -196,3 +322,50 @@ int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a,
 
    return !ferror(f);
 }
+
+static void write_diff(FILE *f, int *n, const char *name,
+                       uint64_t m, uint64_t a)
+{
+   fprintf(f, "%s%s=%08llx,%08llx,%08llx", (*n)++ ? " " : "", name,
+           (unsigned long long)m, (unsigned long long)a,
+           (unsigned long long)(m ^ a));
+}
+
+void reginfo_write_diffs(struct reginfo *m, struct reginfo *a, FILE *f)
+{
+   char name[16];
+   int i, n = 0;
+
+   if (m->faulting_insn != a->faulting_insn)
+      write_diff(f, &n, "insn", m->faulting_insn, a->faulting_insn);
+   if (m->fault_signal != a->fault_signal)
+      write_diff(f, &n, "signal", m->fault_signal, a->fault_signal);
+   if (m->fault_code != a->fault_code)
+      write_diff(f, &n, "si_code", m->fault_code, a->fault_code);
+   if (m->fault_address != a->fault_address)
+      write_diff(f, &n, "fault_addr", m->fault_address, a->fault_address);
+   for (i = 0; i < 16; i++)
+   {
+      if (m->gpreg[i] != a->gpreg[i])
+      {
+         sprintf(name, "r%d", i);
+         write_diff(f, &n, name, m->gpreg[i], a->gpreg[i]);
+      }
+   }
+   if (m->cpsr != a->cpsr)
+      write_diff(f, &n, "cpsr", m->cpsr, a->cpsr);
+   if (reg_profile == RISU_REGS_GPR)
+   {
+      return;
+   }
+   for (i = 0; i < 32; i++)
+   {
+      if (m->fpregs[i] != a->fpregs[i])
+      {
+         sprintf(name, "d%d", i);
+         write_diff(f, &n, name, m->fpregs[i], a->fpregs[i]);
+      }
+   }
+   if (m->fpscr != a->fpscr)
+      write_diff(f, &n, "fpscr", m->fpscr, a->fpscr);
+}
@@ -15,17 +15,24 @@
 
 struct reginfo
 {
-    uint64_t fpregs[32];
     uint32_t faulting_insn;
     uint32_t faulting_insn_size;
     uint32_t gpreg[16];
     uint32_t cpsr;
+    uint32_t fault_signal;
+    uint32_t fault_code;
+    uint32_t fault_address;
+    /* VFP state last, so that RISU_REGS_GPR can leave it off */
+    uint64_t fpregs[32];
     uint32_t fpscr;
 };
 
 /* initialize a reginfo structure with data from uc */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc);
 
+/* Copy the register state in ri back into the ucontext */
+void reginfo_update(struct reginfo *ri, ucontext_t *uc);
+
 /* returns 1 if structs are equal, zero otherwise */
 int reginfo_is_eq(struct reginfo *r1, struct reginfo *r2);
 
@@ -35,4 +42,7 @@ int reginfo_dump(struct reginfo *ri, FILE *f);
 /* print a detailed mismatch report, return 0 on stream err, 1 on success */
 int reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f);
 
+/* write the fields which differ to a --mismatch-log record */
+void reginfo_write_diffs(struct reginfo *m, struct reginfo *a, FILE *f);
+
 #endif /* RISU_REGINFO_ARM_H */